@@ -0,0 +1,22 @@
+#!/bin/bash
+# Runs manet-simulation once per event scheduler and network size and
+# collects the wall clock of every run in scheduler-benchmark.csv.
+# Sizes grow the members of 10 clusters, the head mesh stays at 45 links.
+# Every point-to-point link takes one of the 65535 10.x.y.0/24 subnets of
+# getBaseIP, so the pairwise member mesh is left out: with it 10 clusters of
+# 100 members already need 49500 subnets. Without it a run needs
+# 45 + clusters*members subnets, 60045 for the largest size here.
+report=scheduler-benchmark.csv
+clusters=10
+cp manet-simulation.cc ../ns-allinone-3.36.1/ns-3.36.1/scratch/manet-simulation.cc
+../ns-allinone-3.36.1/ns-3.36.1/ns3 build
+echo "Scheduler,Nodes,Events,WallSeconds" > $report
+for members in 100 1000 6000; do
+    for scheduler in map heap calendar wheel; do
+        line=$(../ns-allinone-3.36.1/ns-3.36.1/ns3 run "scratch/manet-simulation --agent=scripted --scheduler=$scheduler --clusters=$clusters --nodesPerCluster=$members --mobility=batched --memberMesh=false" 2>&1 | grep "^Scheduler $scheduler:")
+        events=$(echo "$line" | awk '{print $3}')
+        seconds=$(echo "$line" | awk '{print $6}' | tr -d 's')
+        echo "$scheduler,$((clusters * members)),$events,$seconds" >> $report
+    done
+done
+cat $report
@@ -0,0 +1,14 @@
+#!/bin/bash
+# Runs manet-simulation once per routing protocol and cluster size and
+# collects one row per run in manet-routing-report.csv
+report=manet-routing-report.csv
+linkMode=${1:-p2p}
+cp manet-simulation.cc ../ns-allinone-3.36.1/ns-3.36.1/scratch/manet-simulation.cc
+../ns-allinone-3.36.1/ns-3.36.1/ns3 build
+rm -f $report
+for nodes in 3 5 10; do
+    for protocol in 0 1 2 3 4; do
+        ../ns-allinone-3.36.1/ns-3.36.1/ns3 run "scratch/manet-simulation --agent=scripted --linkMode=$linkMode --protocol=$protocol --nodesPerCluster=$nodes --reportFile=$PWD/$report"
+    done
+done
+cat $report
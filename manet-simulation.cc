@@ -65,10 +65,18 @@
  *   left commented inline in the program
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <fstream>
 #include <iostream>
+#include <list>
 #include <map>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include "ns3/core-module.h"
 #include "ns3/network-module.h"
 #include "ns3/internet-module.h"
@@ -80,11 +88,25 @@
 #include "ns3/dsr-module.h"
 #include "ns3/applications-module.h"
 #include "ns3/yans-wifi-helper.h"
+#include "ns3/simple-net-device-helper.h"
 #include "ns3/core-module.h"
 #include "ns3/netanim-module.h"
 #include "ns3/opengym-module.h"
 #include "ns3/flow-monitor-module.h"
+#include "ns3/traffic-control-module.h"
 #include <cstdio>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <fcntl.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 
 using namespace ns3;
@@ -93,269 +115,5975 @@ using namespace std;
 
 NS_LOG_COMPONENT_DEFINE ("manet-routing-compare");
 
+int nodesPerCluster = 3;
+int maxClusters = 3;
+const uint16_t echoPort = 9;
+
 uint32_t global_PacketsReceived;
 uint32_t global_PacketsSent;
 multimap<uint32_t, Time> SendingTimes;
-multimap<uint32_t, Time> ReceivingTimes;
 float distance_change = 1.5; 
-vector<double> send_times = { 5.0, 6.0, 7.0, 8.0, 9.0, 10.0, 10.0, 11.0,
-                              11.0, 12.0, 12.0, 13.0, 13.0, 14.0, 14.0,
-                              15.0, 15.0, 16.0, 16.0, 17.0, 17.0, 18.0,
-                              18.0, 19.0, 19.0, 20.0, 21.0, 22.0, 23.0, 24.0};
-uint32_t ptr_send_times [3];
-vector <double> latency_values;
 
-class RoutingExperiment
+// Animation parameters
+const double leftmost_cluster = 10.0;
+const double cluster_x_delta = 30.0;
+const double cluster_head_y = 10.0;
+const double cluster_y = 60.0;
+
+// Topology, kept global so the gym callbacks can act on it at runtime
+std::vector<NodeContainer> clusters, clusterHeads;
+std::vector <NetDeviceContainer> pairwiseConnectionDevices;
+bool member_mesh = true;   // link every pair of members of a cluster, off leaves only the head links
+std::vector <NetDeviceContainer> clusterConnectionDevices;
+std::vector < std::vector<NetDeviceContainer> > intoClusterHeadDevices;
+std::vector <Ipv4InterfaceContainer> pairwiseConnectionInterfaces;
+std::vector <Ipv4InterfaceContainer> connectionInterfaces;
+std::vector < std::vector <Ipv4InterfaceContainer> > intoClusterHeadInterfaces;
+std::vector <Ipv4Address> server_addresses;
+bool global_routing = true;          // false once a MANET routing protocol is installed
+
+// Gym action layer: "server" picks the cluster-0 server each client cluster targets,
+// "rate" sets the DataRate (Mbps) of every head-to-head link and "path" sets the
+// routing metric of every head-to-head link, so global routing can switch paths.
+std::string action_mode = "server";
+double min_link_rate = 1.0;
+double max_link_rate = 10.0;
+uint32_t max_path_metric = 10;
+
+// Gym step triggers, a step is taken when any enabled trigger fires (0 disables a trigger)
+double step_interval = 1.0;          // seconds of simulated time between steps
+bool skip_quiet_steps = false;       // timed steps are skipped when nothing was received since the last one
+uint32_t step_every_packets = 0;     // step after this many echo replies
+double step_latency_threshold = 0.0; // step when a reply RTT (seconds) rises above this
+uint32_t step_queue_threshold = 0;   // step when a head link queue rises above this many packets
+
+// Gym termination conditions, the episode ends when any enabled one is met (0 disables)
+double game_over_time = -1.0;        // seconds of simulated time, negative ends 1s before RunEnd ()
+uint32_t max_steps = 0;
+
+void RequestGymStep (std::string reason);
+
+void OnLatencySample (double latency, uint32_t bytes, uint32_t flow, Time sent);
+void OnMetricsSample (double latency, uint32_t bytes);
+void OnEchoReply (bool first, double rtt);
+void RecomputeGlobalRoutes (void);
+
+/*
+ * Reward engine. Accumulators are updated once per packet and reset at every
+ * gym step, so computing the reward costs the same however many packets
+ * arrived. Latency percentiles are read from a fixed log-spaced histogram
+ * (32 buckets per decade from 1us, about 7% resolution).
+ *
+ * The reward is a weighted sum of metrics given as "metric[:weight],...",
+ * e.g. "p99:-1,loss:-10". Metrics: mean, max, p50, p90, p95, p99 and jitter
+ * (seconds of echo RTT, jitter between consecutive replies of the same
+ * client), goodput (bits/s of echoed payload), loss (fraction of the
+ * requests sent during the previous step still without a reply, so every
+ * request has at least a step to be answered) and received (replies).
+ */
+class RewardEngine
 {
 public:
-  RoutingExperiment ();
-  void Run (int nSinks, double txp, std::string CSVfileName);
-  std::string CommandSetup (int argc, char **argv);
-  
+  RewardEngine ();
+  void Configure (std::string spec);
+  void OnSent (void);
+  void OnReceived (double latency, uint32_t bytes, uint32_t flow, Time sent);
+  double GetMetric (std::string metric) const;
+  float Compute (void);
+
 private:
-  Ptr<Socket> SetupPacketReceive (Ipv4Address addr, Ptr<Node> node, uint32_t checkPort);
-  Ptr<Socket> SetupPacketSend(Ipv4Address addr, Ptr<Node> node, uint32_t checkPort);
-  void ReceivePacket (Ptr<Socket> socket);
-  void SendPacket (Ptr<Socket> socket, uint32_t bytes);
-  void CheckThroughput ();
-  
+  void Reset (void);
+  double Percentile (double q) const;
 
-  uint32_t port;
-  uint32_t bytesTotal;
-  uint32_t packetsReceived;
+  static const uint32_t m_nBuckets = 256;
+  double m_minLatency;
+  double m_bucketsPerDecade;
+  std::vector<uint32_t> m_histogram;
+  std::vector< std::pair<std::string, double> > m_weights;
 
-  std::string m_CSVfileName;
-  int m_nSinks;
-  std::string m_protocolName;
-  double m_txp;
-  bool m_traceMobility;
-  uint32_t m_protocol;
+  uint32_t m_sent;              // requests sent this step
+  uint32_t m_answered;          // replies to them so far
+  uint32_t m_sentBefore;        // requests sent the previous step
+  uint32_t m_answeredBefore;    // replies to them so far
+  uint32_t m_received;
+  uint64_t m_bytesReceived;
+  double m_latencySum;
+  double m_latencyMax;
+  double m_jitterSum;
+  uint32_t m_jitterSamples;
+  std::map<uint32_t, double> m_lastLatency;   // per flow, kept across steps
+  Time m_stepStart;
+  Time m_previousStart;
 };
 
-Ptr<OpenGymSpace> MyGetObservationSpace(void)
+RewardEngine::RewardEngine ()
+  : m_minLatency (1e-6),
+    m_bucketsPerDecade (32.0),
+    m_histogram (m_nBuckets, 0)
 {
-  uint32_t nodeNum = 3;
-  float low = 0.0;
-  float high = 100.0;
-  std::vector<uint32_t> shape = {nodeNum,};
-  std::string dtype = TypeNameGet<uint32_t> ();
-  Ptr<OpenGymBoxSpace> space = CreateObject<OpenGymBoxSpace> (low, high, shape, dtype);
-  NS_LOG_UNCOND ("MyGetObservationSpace: " << space);
-  return space;
+  m_weights.push_back (std::make_pair (std::string ("mean"), 1.0));
+  // Not Reset (), the simulator must not be touched before the command line is parsed
+  m_sent = 0;
+  m_answered = 0;
+  m_sentBefore = 0;
+  m_answeredBefore = 0;
+  m_received = 0;
+  m_bytesReceived = 0;
+  m_latencySum = 0.0;
+  m_latencyMax = 0.0;
+  m_jitterSum = 0.0;
+  m_jitterSamples = 0;
 }
 
-Ptr<OpenGymSpace> MyGetActionSpace(void)
+void
+RewardEngine::Configure (std::string spec)
 {
-  uint32_t nodeNum = 3;
-  Ptr<OpenGymDiscreteSpace> space = CreateObject<OpenGymDiscreteSpace> (nodeNum);
-  NS_LOG_UNCOND ("MyGetActionSpace: " << space);
-  return space;
+  m_weights.clear ();
+  std::istringstream terms (spec);
+  std::string term;
+  while (std::getline (terms, term, ','))
+    {
+      std::string metric = term;
+      double weight = 1.0;
+      size_t colon = term.find (':');
+      if (colon != std::string::npos)
+        {
+          metric = term.substr (0, colon);
+          std::string value = term.substr (colon + 1);
+          char *end = 0;
+          weight = std::strtod (value.c_str (), &end);
+          NS_ABORT_MSG_IF (value.empty () || *end != '\0', "Malformed reward weight in " << term);
+        }
+      if (metric != "mean" && metric != "max" && metric != "p50" && metric != "p90"
+          && metric != "p95" && metric != "p99" && metric != "jitter"
+          && metric != "goodput" && metric != "loss" && metric != "received")
+        {
+          NS_FATAL_ERROR ("Unknown reward metric " << metric);
+        }
+      m_weights.push_back (std::make_pair (metric, weight));
+    }
 }
 
+void
+RewardEngine::Reset (void)
+{
+  std::fill (m_histogram.begin (), m_histogram.end (), 0);
+  m_sentBefore = m_sent;
+  m_answeredBefore = m_answered;
+  m_sent = 0;
+  m_answered = 0;
+  m_received = 0;
+  m_bytesReceived = 0;
+  m_latencySum = 0.0;
+  m_latencyMax = 0.0;
+  m_jitterSum = 0.0;
+  m_jitterSamples = 0;
+  m_previousStart = m_stepStart;
+  m_stepStart = Simulator::Now ();
+}
 
-bool MyGetGameOver(void)
+void
+RewardEngine::OnSent (void)
 {
+  m_sent ++;
+}
 
-  bool isGameOver = false;
-  static float stepCounter = 0.0;
-  stepCounter += 1;
-  global_PacketsSent = stepCounter*4;
-  if ( Simulator::Now().Compare(Time("29s")) >= 0) {
-      isGameOver = true;
-  }
-  NS_LOG_UNCOND ("MyGetGameOver: " << isGameOver);
-  return isGameOver;
+void
+RewardEngine::OnReceived (double latency, uint32_t bytes, uint32_t flow, Time sent)
+{
+  double position = std::log10 (std::max (latency, m_minLatency) / m_minLatency) * m_bucketsPerDecade;
+  uint32_t bucket = std::min ((uint32_t) position, m_nBuckets - 1);
+  m_histogram[bucket] ++;
+
+  std::map<uint32_t, double>::iterator last = m_lastLatency.find (flow);
+  if (last != m_lastLatency.end ())
+    {
+      m_jitterSum += std::abs (latency - last->second);
+      m_jitterSamples ++;
+      last->second = latency;
+    }
+  else
+    {
+      m_lastLatency[flow] = latency;
+    }
+  // Replies to requests older than the previous step no longer count
+  if (sent >= m_stepStart)
+    {
+      m_answered ++;
+    }
+  else if (sent >= m_previousStart)
+    {
+      m_answeredBefore ++;
+    }
+  m_received ++;
+  m_bytesReceived += bytes;
+  m_latencySum += latency;
+  m_latencyMax = std::max (m_latencyMax, latency);
 }
 
+double
+RewardEngine::Percentile (double q) const
+{
+  if (m_received == 0) return 0.0;
+  uint32_t rank = std::max<uint32_t> (1, (uint32_t) std::ceil (q * m_received));
+  uint32_t seen = 0;
+  for (uint32_t bucket = 0; bucket < m_nBuckets; bucket++)
+    {
+      seen += m_histogram[bucket];
+      if (seen >= rank)
+        {
+          // Geometric centre of the bucket, capped by the largest sample
+          double centre = m_minLatency * std::pow (10.0, (bucket + 0.5) / m_bucketsPerDecade);
+          return std::min (centre, m_latencyMax);
+        }
+    }
+  return m_latencyMax;
+}
 
-Ptr<OpenGymDataContainer> MyGetObservation(void)
+double
+RewardEngine::GetMetric (std::string metric) const
 {
-  //Define the base observation space
-  uint32_t nodeNum = 3;
+  if (metric == "received") return m_received;
+  if (metric == "loss")
+    {
+      if (m_sentBefore == 0) return 0.0;
+      return std::max (0.0, 1.0 - (double) m_answeredBefore / (double) m_sentBefore);
+    }
+  if (metric == "goodput")
+    {
+      double elapsed = (Simulator::Now () - m_stepStart).GetSeconds ();
+      return elapsed > 0 ? m_bytesReceived * 8.0 / elapsed : 0.0;
+    }
+  if (m_received == 0) return 0.0;
+  if (metric == "mean") return m_latencySum / m_received;
+  if (metric == "max") return m_latencyMax;
+  if (metric == "jitter") return m_jitterSamples > 0 ? m_jitterSum / m_jitterSamples : 0.0;
+  if (metric == "p50") return Percentile (0.50);
+  if (metric == "p90") return Percentile (0.90);
+  if (metric == "p95") return Percentile (0.95);
+  if (metric == "p99") return Percentile (0.99);
+  return 0.0;
+}
 
-  std::vector<uint32_t> shape = {nodeNum,};
-  Ptr<OpenGymBoxContainer<uint32_t> > box = CreateObject<OpenGymBoxContainer<uint32_t> >(shape);
-  
-    for (uint32_t i=0; i<nodeNum; i++)
+// Weighted reward of the current step, then starts accumulating the next one
+float
+RewardEngine::Compute (void)
+{
+  double reward = 0.0;
+  for (const auto &weight : m_weights)
     {
-      Ptr<Node> node = NodeList::GetNode(i);
+      reward += weight.second * GetMetric (weight.first);
+    }
+  Reset ();
+  return (float) reward;
+}
 
-        //Extract the position from the hierarchy 2 nodes
-      Ptr<MobilityModel> cpMob = node->GetObject<MobilityModel>();
-      Vector m_position = cpMob->GetPosition();
-      box->AddValue(m_position.x);
-      
+std::string reward_spec = "mean";
+RewardEngine reward_engine;
+
+/*
+ * Delay, jitter, loss and goodput aggregated by (source cluster, destination
+ * cluster). Cells are flat arrays indexed src*clusters+dst, so a sample is a
+ * handful of additions and one histogram increment. Two sets of cells are
+ * kept: the current interval, cleared by every Flush, and the whole run.
+ * Percentiles come from the same log scaled histogram the sinks use. Flow
+ * sinks add one way delays and sequence losses; in echo mode the clients
+ * add round trip times (src is the client's cluster) and no losses. Jitter
+ * is averaged over the packets that had a predecessor in their flow.
+ */
+class ClusterMatrix
+{
+public:
+  static const uint32_t delayBuckets = 48;    // 8 per decade from 1us to 1s
+  static uint32_t DelayBucket (double delay);
+  static double BucketDelay (uint32_t bucket);  // upper edge in seconds
+
+  ClusterMatrix ();
+  void Resize (uint32_t clusters);
+  void OnReceived (uint32_t src, uint32_t dst, uint32_t bytes, double delay, double jitter, bool firstOfFlow);
+  void OnLost (uint32_t src, uint32_t dst, int64_t packets);
+  void Open (std::string fileName, double interval);
+  void Flush (void);     // write and clear the interval cells, reschedules itself
+  void WriteTotal (void);
+  double GetPercentile (uint32_t src, uint32_t dst, double q) const;  // whole run
+  double GetLoss (uint32_t src, uint32_t dst) const;                  // whole run
+
+private:
+  struct Cell
+  {
+    uint64_t packets;
+    uint64_t bytes;
+    int64_t lost;
+    double delaySum;
+    double jitterSum;
+    uint64_t jitterSamples;
+    uint32_t histogram[delayBuckets];
+  };
+  static double Percentile (const Cell &cell, double q);
+  void Write (const std::vector<Cell> &cells, std::string label, double seconds);
+
+  uint32_t m_clusters;
+  std::vector<Cell> m_interval;
+  std::vector<Cell> m_total;
+  std::ofstream m_out;
+  double m_flushInterval;
+  Time m_intervalStart;
+};
+
+ClusterMatrix::ClusterMatrix ()
+  : m_clusters (0),
+    m_flushInterval (0.0)
+{
+}
+
+uint32_t
+ClusterMatrix::DelayBucket (double delay)
+{
+  int bucket = (int) std::ceil (std::log10 (std::max (delay, 1e-6) / 1e-6) * 8);
+  return std::min (std::max (bucket, 0), (int) delayBuckets - 1);
+}
+
+double
+ClusterMatrix::BucketDelay (uint32_t bucket)
+{
+  return 1e-6 * std::pow (10.0, bucket / 8.0);
+}
+
+void
+ClusterMatrix::Resize (uint32_t clusters)
+{
+  Cell empty;
+  std::memset (&empty, 0, sizeof (empty));
+  m_clusters = clusters;
+  m_interval.assign (clusters * clusters, empty);
+  m_total.assign (clusters * clusters, empty);
+}
+
+void
+ClusterMatrix::OnReceived (uint32_t src, uint32_t dst, uint32_t bytes, double delay, double jitter, bool firstOfFlow)
+{
+  uint32_t bucket = DelayBucket (delay);
+  for (Cell *cell : {&m_interval[src * m_clusters + dst], &m_total[src * m_clusters + dst]})
+    {
+      cell->packets ++;
+      cell->bytes += bytes;
+      cell->delaySum += delay;
+      if (!firstOfFlow)
+        {
+          cell->jitterSum += jitter;
+          cell->jitterSamples ++;
+        }
+      cell->histogram[bucket] ++;
     }
-  NS_LOG_UNCOND ("MyGetObservation: " << box);
-  return box;
 }
 
-float MyGetReward(void)
+void
+ClusterMatrix::OnLost (uint32_t src, uint32_t dst, int64_t packets)
 {
-  if(latency_values.empty()) return 0.0;
-  double sum = 0.0;
-  for(const auto &lat : latency_values){
-    sum += lat;
-  }
-  double mean = sum / (double) latency_values.size();
-  latency_values.clear();
-  return  (float) mean;
+  m_interval[src * m_clusters + dst].lost += packets;
+  m_total[src * m_clusters + dst].lost += packets;
 }
 
-bool MyExecuteActions(Ptr<OpenGymDataContainer> action)
+double
+ClusterMatrix::Percentile (const Cell &cell, double q)
 {
-  Ptr<OpenGymDiscreteContainer> discrete = DynamicCast<OpenGymDiscreteContainer>(action);
-  NS_LOG_UNCOND ("MyExecuteActions: " << action);
-  return true;
+  if (cell.packets == 0) return 0.0;
+  uint64_t rank = std::max<uint64_t> (1, (uint64_t) std::ceil (q * cell.packets));
+  uint64_t seen = 0;
+  for (uint32_t bucket = 0; bucket < delayBuckets; bucket++)
+    {
+      seen += cell.histogram[bucket];
+      if (seen >= rank) return BucketDelay (bucket);
+    }
+  return BucketDelay (delayBuckets - 1);
 }
 
-void ScheduleNextStateRead(double envStepTime, Ptr<OpenGymInterface> openGym)
+double
+ClusterMatrix::GetPercentile (uint32_t src, uint32_t dst, double q) const
 {
-  Simulator::Schedule (Seconds(envStepTime), &ScheduleNextStateRead, envStepTime, openGym);
-  openGym->NotifyCurrentState();
+  return Percentile (m_total[src * m_clusters + dst], q);
 }
 
+double
+ClusterMatrix::GetLoss (uint32_t src, uint32_t dst) const
+{
+  const Cell &cell = m_total[src * m_clusters + dst];
+  int64_t lost = std::max<int64_t> (cell.lost, 0);
+  return (cell.packets + lost) > 0 ? (double) lost / (cell.packets + lost) : 0.0;
+}
 
-RoutingExperiment::RoutingExperiment ()
-  : port (9),
-    bytesTotal (0),
-    packetsReceived (0),
-    m_CSVfileName ("manet-simulation.output.csv"),
-    m_traceMobility (false),
-    m_protocol (2) // AODV
+void
+ClusterMatrix::Open (std::string fileName, double interval)
+{
+  m_out.open (fileName.c_str ());
+  NS_ABORT_MSG_IF (!m_out.is_open (), "Cannot open cluster matrix file " << fileName);
+  m_out << "Time,Metric";
+  for (uint32_t src = 0; src < m_clusters; src++)
+    {
+      for (uint32_t dst = 0; dst < m_clusters; dst++)
+        {
+          m_out << "," << src << "to" << dst;
+        }
+    }
+  m_out << std::endl;
+  m_flushInterval = interval;
+  m_intervalStart = Simulator::Now ();
+  if (interval > 0)
+    {
+      Simulator::Schedule (Seconds (interval), &ClusterMatrix::Flush, this);
+    }
+}
+
+// One row per metric, one column per (src, dst) cell
+void
+ClusterMatrix::Write (const std::vector<Cell> &cells, std::string label, double seconds)
+{
+  const char *metrics[] = {"packets", "loss", "mean", "p99", "jitter", "goodput"};
+  for (const char *metric : metrics)
+    {
+      m_out << label << "," << metric;
+      for (const Cell &cell : cells)
+        {
+          int64_t lost = std::max<int64_t> (cell.lost, 0);
+          double value = 0.0;
+          std::string name = metric;
+          if (name == "packets") value = cell.packets;
+          else if (name == "loss") value = (cell.packets + lost) > 0 ? (double) lost / (cell.packets + lost) : 0.0;
+          else if (name == "mean") value = cell.packets > 0 ? cell.delaySum / cell.packets : 0.0;
+          else if (name == "p99") value = Percentile (cell, 0.99);
+          else if (name == "jitter") value = cell.jitterSamples > 0 ? cell.jitterSum / cell.jitterSamples : 0.0;
+          else value = seconds > 0 ? cell.bytes * 8.0 / seconds : 0.0;
+          m_out << "," << value;
+        }
+      m_out << std::endl;
+    }
+}
+
+void
+ClusterMatrix::Flush (void)
+{
+  if (!m_out.is_open ()) return;
+  double seconds = (Simulator::Now () - m_intervalStart).GetSeconds ();
+  std::ostringstream label;
+  label << Simulator::Now ().GetSeconds ();
+  Write (m_interval, label.str (), seconds);
+  Cell empty;
+  std::memset (&empty, 0, sizeof (empty));
+  std::fill (m_interval.begin (), m_interval.end (), empty);
+  m_intervalStart = Simulator::Now ();
+  Simulator::Schedule (Seconds (m_flushInterval), &ClusterMatrix::Flush, this);
+}
+
+void
+ClusterMatrix::WriteTotal (void)
 {
+  if (!m_out.is_open ()) return;
+  Write (m_total, "total", Simulator::Now ().GetSeconds ());
+  m_out.close ();
 }
 
-static inline std::string
-PrintReceivedPacket (Ptr<Socket> socket, Ptr<Packet> packet, Address senderAddress)
+ClusterMatrix cluster_matrix;
+std::string cluster_matrix_file = "";
+double cluster_matrix_interval = 1.0;
+std::map<uint32_t, uint32_t> address_cluster;   // member address -> home cluster
+
+/*
+ * Online convergence monitor. Received packets are folded into the current
+ * batch (bytes, delay sum, delay histogram); every BatchInterval the batch is
+ * closed into one value per tracked metric (throughput, mean, p50, p90,
+ * p99). After the warmup batches are dropped, the batch means give a 95%
+ * confidence half width per metric. The run stops as soon as every metric is
+ * within the relative precision, and otherwise runs on until maxSimTime.
+ * While the lag 1 autocorrelation of the batch means is high the run never
+ * counts as converged, and neighbouring batches are merged once there are
+ * enough of them, so the batches stay close to independent. Only one kind of
+ * delay is tracked: echo round trip times or flow sink one way delays,
+ * whichever the traffic mode produces; samples of the other kind are ignored.
+ */
+class ConvergenceMonitor
 {
-  std::ostringstream oss;
+public:
+  ConvergenceMonitor ();
+  void Configure (std::string metrics, double precision, double batchInterval,
+                  uint32_t warmupBatches, uint32_t minBatches, bool roundTrip);
+  bool IsEnabled (void) const;
+  void Start (void);
+  void OnReceived (double delay, uint32_t bytes, bool roundTrip);
+  bool HasConverged (void) const;
 
-  oss << Simulator::Now ().GetSeconds () << " " << socket->GetNode ()->GetId ();
+private:
+  static double StudentT975 (uint32_t df);
+  double BatchValue (std::string metric) const;
+  void CloseBatch (void);
+  bool Check (void);
+  void MergeBatches (void);
+
+  std::vector<std::string> m_metrics;
+  std::vector< std::vector<double> > m_batches;   // per metric, one value per batch
+  double m_precision;
+  double m_batchInterval;
+  uint32_t m_warmupBatches;
+  uint32_t m_minBatches;
+  bool m_roundTrip;         // tracks echo round trips, otherwise one way delays
+  uint32_t m_closed;
+  uint32_t m_batchSpan;     // intervals per batch after merges
+  uint32_t m_spanClosed;
+  bool m_converged;
+
+  uint64_t m_packets;
+  uint64_t m_bytes;
+  double m_delaySum;
+  uint32_t m_histogram[ClusterMatrix::delayBuckets];
+};
 
-  if (InetSocketAddress::IsMatchingType (senderAddress))
+ConvergenceMonitor::ConvergenceMonitor ()
+  : m_precision (0.05),
+    m_batchInterval (1.0),
+    m_warmupBatches (5),
+    m_minBatches (10),
+    m_roundTrip (true),
+    m_closed (0),
+    m_batchSpan (1),
+    m_spanClosed (0),
+    m_converged (false),
+    m_packets (0),
+    m_bytes (0),
+    m_delaySum (0.0)
+{
+  std::memset (m_histogram, 0, sizeof (m_histogram));
+}
+
+void
+ConvergenceMonitor::Configure (std::string metrics, double precision, double batchInterval,
+                               uint32_t warmupBatches, uint32_t minBatches, bool roundTrip)
+{
+  m_metrics.clear ();
+  std::istringstream list (metrics);
+  std::string metric;
+  while (std::getline (list, metric, ','))
     {
-      InetSocketAddress addr = InetSocketAddress::ConvertFrom (senderAddress);
-      oss << " received one packet from " << addr.GetIpv4 ();
+      if (metric.empty ()) continue;
+      NS_ABORT_MSG_IF (metric != "throughput" && metric != "mean" && metric != "p50"
+                       && metric != "p90" && metric != "p99", "Unknown convergence metric " << metric);
+      m_metrics.push_back (metric);
     }
-  else
+  m_batches.assign (m_metrics.size (), std::vector<double> ());
+  m_precision = precision;
+  m_batchInterval = batchInterval;
+  m_warmupBatches = warmupBatches;
+  m_minBatches = std::max<uint32_t> (minBatches, 2);
+  m_roundTrip = roundTrip;
+}
+
+bool
+ConvergenceMonitor::IsEnabled (void) const
+{
+  return !m_metrics.empty ();
+}
+
+bool
+ConvergenceMonitor::HasConverged (void) const
+{
+  return m_converged;
+}
+
+void
+ConvergenceMonitor::Start (void)
+{
+  Simulator::Schedule (Seconds (m_batchInterval), &ConvergenceMonitor::CloseBatch, this);
+}
+
+void
+ConvergenceMonitor::OnReceived (double delay, uint32_t bytes, bool roundTrip)
+{
+  if (roundTrip != m_roundTrip) return;
+  m_packets ++;
+  m_bytes += bytes;
+  m_delaySum += delay;
+  m_histogram[ClusterMatrix::DelayBucket (delay)] ++;
+}
+
+double
+ConvergenceMonitor::StudentT975 (uint32_t df)
+{
+  static const double table[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                                 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+  if (df == 0) return table[0];
+  if (df <= 30) return table[df - 1];
+  return 1.960 + 2.4 / df;
+}
+
+double
+ConvergenceMonitor::BatchValue (std::string metric) const
+{
+  if (metric == "throughput") return m_bytes * 8.0 / (m_batchInterval * m_batchSpan);
+  if (m_packets == 0) return 0.0;
+  if (metric == "mean") return m_delaySum / m_packets;
+  double q = (metric == "p50") ? 0.50 : (metric == "p90") ? 0.90 : 0.99;
+  uint64_t rank = std::max<uint64_t> (1, (uint64_t) std::ceil (q * m_packets));
+  uint64_t seen = 0;
+  for (uint32_t bucket = 0; bucket < ClusterMatrix::delayBuckets; bucket++)
     {
-      oss << " received one packet!";
+      seen += m_histogram[bucket];
+      if (seen >= rank) return ClusterMatrix::BucketDelay (bucket);
     }
+  return ClusterMatrix::BucketDelay (ClusterMatrix::delayBuckets - 1);
+}
 
-  
-  return oss.str ();
+void
+ConvergenceMonitor::CloseBatch (void)
+{
+  Simulator::Schedule (Seconds (m_batchInterval), &ConvergenceMonitor::CloseBatch, this);
+  if (++m_spanClosed < m_batchSpan) return;
+  m_spanClosed = 0;
+
+  if (m_closed++ >= m_warmupBatches)
+    {
+      for (uint32_t i = 0; i < m_metrics.size (); i++)
+        {
+          m_batches[i].push_back (BatchValue (m_metrics[i]));
+        }
+    }
+  m_packets = 0;
+  m_bytes = 0;
+  m_delaySum = 0.0;
+  std::memset (m_histogram, 0, sizeof (m_histogram));
+
+  if (!m_converged && Check ())
+    {
+      m_converged = true;
+      // The episode sees the end: its last step runs before the stop event
+      RequestGymStep ("converged");
+      Simulator::Stop (Seconds (0));
+    }
 }
 
-int cont = 0;
-void RoutingExperiment::ReceivePacket (Ptr<Socket> socket)
-{ 
-  ReceivingTimes.insert(pair<uint32_t,Time>(socket->GetNode()->GetId() , Simulator::Now ()));
-  uint32_t nodeId = socket->GetNode()->GetId();
-  double currentLatency = Simulator::Now ().GetSeconds() - send_times[ptr_send_times[nodeId]];
-  ptr_send_times[nodeId] ++;
-  latency_values.push_back(currentLatency);
-  NS_LOG_UNCOND ("node: "+ std::to_string(socket->GetNode()->GetId())+" received back a packet at "+std::to_string(Simulator::Now().GetSeconds())+ " seconds " + std::to_string(currentLatency) + "BBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBB");
-  NS_LOG_UNCOND ("ReceivePacket count: "+ std::to_string(++ cont));
+// Pairs of batches become one, later batches cover twice the time
+void
+ConvergenceMonitor::MergeBatches (void)
+{
+  for (auto &values : m_batches)
+    {
+      std::vector<double> merged;
+      for (uint32_t i = 0; i + 1 < values.size (); i += 2)
+        {
+          merged.push_back ((values[i] + values[i + 1]) / 2.0);
+        }
+      values.swap (merged);
+    }
+  m_batchSpan *= 2;
 }
 
-std::string
-RoutingExperiment::CommandSetup (int argc, char **argv)
+bool
+ConvergenceMonitor::Check (void)
 {
-  CommandLine cmd (__FILE__);
-  cmd.AddValue ("CSVfileName", "The name of the CSV output file name", m_CSVfileName);
-  cmd.AddValue ("traceMobility", "Enable mobility tracing", m_traceMobility);
-  cmd.AddValue ("protocol", "1=OLSR;2=AODV;3=DSDV;4=DSR", m_protocol);
-  cmd.Parse (argc, argv);
-  return m_CSVfileName;
+  if (m_batches.empty () || m_batches[0].size () < m_minBatches) return false;
+
+  std::ostringstream summary;
+  bool precise = true;
+  for (uint32_t i = 0; i < m_metrics.size (); i++)
+    {
+      const std::vector<double> &values = m_batches[i];
+      uint32_t n = values.size ();
+      double mean = 0.0;
+      for (double value : values) mean += value;
+      mean /= n;
+      double variance = 0.0;
+      double lag1 = 0.0;
+      for (uint32_t b = 0; b < n; b++)
+        {
+          variance += (values[b] - mean) * (values[b] - mean);
+          if (b > 0) lag1 += (values[b] - mean) * (values[b - 1] - mean);
+        }
+      if (variance > 0 && lag1 / variance > 0.2)
+        {
+          if (n >= 2 * m_minBatches)
+            {
+              MergeBatches ();
+            }
+          return false;
+        }
+      variance /= (n - 1);
+      double halfWidth = StudentT975 (n - 1) * std::sqrt (variance / n);
+      if (mean == 0.0 || halfWidth / std::abs (mean) > m_precision) precise = false;
+      summary << " " << m_metrics[i] << " " << mean << " +- " << halfWidth;
+    }
+  if (precise)
+    {
+      NS_LOG_UNCOND ("Converged at " << Simulator::Now ().GetSeconds () << "s after "
+                     << m_batches[0].size () << " batches of " << (m_roundTrip ? "round trip" : "one way")
+                     << " delays:" << summary.str ());
+    }
+  return precise;
 }
 
-int main (int argc, char *argv[])
+std::string convergence_metrics = "";   // empty runs for the fixed duration
+double convergence_precision = 0.05;
+double batch_interval = 1.0;
+uint32_t warmup_batches = 5;
+uint32_t min_batches = 10;
+double sim_duration = 30.0;
+double max_sim_time = 300.0;
+ConvergenceMonitor convergence_monitor;
+
+// Applications run until the end of the longest run the settings allow
+double RunEnd(void)
 {
-  RoutingExperiment experiment;
-  std::string CSVfileName = experiment.CommandSetup (argc,argv);
+  return convergence_monitor.IsEnabled () ? max_sim_time : sim_duration;
+}
 
-  //blank out the last output file and write the column headers
-  std::ofstream out (CSVfileName.c_str ());
-  out << "SimulationSecond," <<
-  "ReceiveRate," <<
-  "PacketsReceived," <<
-  "NumberOfSinks," <<
-  "RoutingProtocol," <<
-  "TransmissionPower" <<
-  std::endl;
-  out.close ();
+// Sources of cluster c start c staggers in and all send for the same span,
+// the last one stopping a stagger before the end; 5s staggers when the run allows
+double SourceStagger(void)
+{
+  return std::min (5.0, RunEnd () / (2.0 * maxClusters));
+}
 
-  int nSinks = 3;
-  double txp = 7.5;
+double SourceStart(uint32_t cluster)
+{
+  return SourceStagger () * cluster;
+}
 
-  experiment.Run (nSinks, txp, CSVfileName);
+double SourceStop(uint32_t cluster)
+{
+  return SourceStart (cluster) + RunEnd () - SourceStagger () * maxClusters;
+}
+
+// The gym episode ends with the run unless --simTime says otherwise
+double GameOverTime(void)
+{
+  return game_over_time >= 0 ? game_over_time : std::max (RunEnd () - 1.0, RunEnd () / 2.0);
+}
+
+/*
+ * Timestamps of one echo exchange: the client stamps its send time, the
+ * server stamps arrival and send. All stamps come from the one simulator
+ * clock, so the forward, processing and return parts need no skew handling.
+ */
+class EchoTimingHeader : public Header
+{
+public:
+  static TypeId GetTypeId (void);
+  virtual TypeId GetInstanceTypeId (void) const;
+  virtual void Print (std::ostream &os) const;
+  virtual uint32_t GetSerializedSize (void) const;
+  virtual void Serialize (Buffer::Iterator start) const;
+  virtual uint32_t Deserialize (Buffer::Iterator start);
+
+  uint32_t seq;
+  Time clientTx;
+  Time serverRx;
+  Time serverTx;
+};
+
+NS_OBJECT_ENSURE_REGISTERED (EchoTimingHeader);
+
+TypeId
+EchoTimingHeader::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("EchoTimingHeader")
+    .SetParent<Header> ()
+    .SetGroupName ("Applications")
+    .AddConstructor<EchoTimingHeader> ()
+  ;
+  return tid;
+}
+
+TypeId
+EchoTimingHeader::GetInstanceTypeId (void) const
+{
+  return GetTypeId ();
+}
+
+void
+EchoTimingHeader::Print (std::ostream &os) const
+{
+  os << "(seq=" << seq << " clientTx=" << clientTx.As (Time::S) << " serverRx=" << serverRx.As (Time::S)
+     << " serverTx=" << serverTx.As (Time::S) << ")";
+}
+
+uint32_t
+EchoTimingHeader::GetSerializedSize (void) const
+{
+  return 4 + 3 * 8;
+}
+
+void
+EchoTimingHeader::Serialize (Buffer::Iterator start) const
+{
+  start.WriteHtonU32 (seq);
+  start.WriteHtonU64 (clientTx.GetTimeStep ());
+  start.WriteHtonU64 (serverRx.GetTimeStep ());
+  start.WriteHtonU64 (serverTx.GetTimeStep ());
+}
+
+uint32_t
+EchoTimingHeader::Deserialize (Buffer::Iterator start)
+{
+  seq = start.ReadNtohU32 ();
+  clientTx = TimeStep (start.ReadNtohU64 ());
+  serverRx = TimeStep (start.ReadNtohU64 ());
+  serverTx = TimeStep (start.ReadNtohU64 ());
+  return GetSerializedSize ();
+}
+
+/*
+ * Echo server that stamps arrival and send time into the EchoTimingHeader
+ * of every request before returning it. ProcessingTime holds the reply back
+ * to model a busy server.
+ */
+class TimestampedEchoServer : public Application
+{
+public:
+  static TypeId GetTypeId (void);
+  TimestampedEchoServer ();
+  virtual ~TimestampedEchoServer ();
+
+private:
+  virtual void StartApplication (void);
+  virtual void StopApplication (void);
+  void HandleRead (Ptr<Socket> socket);
+  void Reply (Ptr<Packet> packet, EchoTimingHeader timing, Address from);
+
+  uint16_t m_port;
+  Time m_processing;
+  Ptr<Socket> m_socket;
+};
+
+NS_OBJECT_ENSURE_REGISTERED (TimestampedEchoServer);
+
+TypeId
+TimestampedEchoServer::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("TimestampedEchoServer")
+    .SetParent<Application> ()
+    .SetGroupName ("Applications")
+    .AddConstructor<TimestampedEchoServer> ()
+    .AddAttribute ("Port", "Port on which we listen for incoming packets.",
+                   UintegerValue (echoPort),
+                   MakeUintegerAccessor (&TimestampedEchoServer::m_port),
+                   MakeUintegerChecker<uint16_t> ())
+    .AddAttribute ("ProcessingTime", "Time between the arrival of a request and its reply",
+                   TimeValue (Seconds (0.0)),
+                   MakeTimeAccessor (&TimestampedEchoServer::m_processing),
+                   MakeTimeChecker ())
+  ;
+  return tid;
+}
+
+TimestampedEchoServer::TimestampedEchoServer ()
+  : m_port (echoPort),
+    m_socket (0)
+{
+}
+
+TimestampedEchoServer::~TimestampedEchoServer ()
+{
+  m_socket = 0;
+}
+
+void
+TimestampedEchoServer::StartApplication (void)
+{
+  if (m_socket == 0)
+    {
+      TypeId tid = TypeId::LookupByName ("ns3::UdpSocketFactory");
+      m_socket = Socket::CreateSocket (GetNode (), tid);
+      if (m_socket->Bind (InetSocketAddress (Ipv4Address::GetAny (), m_port)) == -1)
+        {
+          NS_FATAL_ERROR ("Failed to bind socket");
+        }
+    }
+  m_socket->SetRecvCallback (MakeCallback (&TimestampedEchoServer::HandleRead, this));
+}
+
+void
+TimestampedEchoServer::StopApplication (void)
+{
+  if (m_socket != 0)
+    {
+      m_socket->Close ();
+      m_socket->SetRecvCallback (MakeNullCallback<void, Ptr<Socket> > ());
+    }
+}
+
+void
+TimestampedEchoServer::HandleRead (Ptr<Socket> socket)
+{
+  Ptr<Packet> packet;
+  Address from;
+  while ((packet = socket->RecvFrom (from)))
+    {
+      EchoTimingHeader timing;
+      if (packet->GetSize () < timing.GetSerializedSize ()) continue;
+      packet->RemoveHeader (timing);
+      timing.serverRx = Simulator::Now ();
+      if (m_processing.IsZero ())
+        {
+          Reply (packet, timing, from);
+        }
+      else
+        {
+          Simulator::Schedule (m_processing, &TimestampedEchoServer::Reply, this, packet, timing, from);
+        }
+    }
+}
+
+void
+TimestampedEchoServer::Reply (Ptr<Packet> packet, EchoTimingHeader timing, Address from)
+{
+  if (m_socket == 0) return;
+  timing.serverTx = Simulator::Now ();
+  packet->AddHeader (timing);
+  m_socket->SendTo (packet, 0, from);
+}
+
+/*
+ * Forward, server processing and return delay of echo exchanges, as sums,
+ * maxima and log scaled histograms per direction. Clients keep one each;
+ * cluster figures are the Merge of their clients.
+ */
+struct EchoBreakdown
+{
+  enum Part { FORWARD = 0, PROCESSING = 1, RETURN = 2, PARTS = 3 };
+
+  EchoBreakdown ()
+  {
+    std::memset (this, 0, sizeof (*this));
+  }
+
+  void Add (const EchoTimingHeader &timing, Time now)
+  {
+    double parts[PARTS] = {(timing.serverRx - timing.clientTx).GetSeconds (),
+                           (timing.serverTx - timing.serverRx).GetSeconds (),
+                           (now - timing.serverTx).GetSeconds ()};
+    for (int part = 0; part < PARTS; part++)
+      {
+        sum[part] += parts[part];
+        max[part] = std::max (max[part], parts[part]);
+        histogram[part][ClusterMatrix::DelayBucket (parts[part])] ++;
+      }
+    count ++;
+  }
+
+  void Merge (const EchoBreakdown &other)
+  {
+    for (int part = 0; part < PARTS; part++)
+      {
+        sum[part] += other.sum[part];
+        max[part] = std::max (max[part], other.max[part]);
+        for (uint32_t bucket = 0; bucket < ClusterMatrix::delayBuckets; bucket++)
+          {
+            histogram[part][bucket] += other.histogram[part][bucket];
+          }
+      }
+    count += other.count;
+  }
+
+  double Mean (int part) const
+  {
+    return count > 0 ? sum[part] / count : 0.0;
+  }
+
+  double Percentile (int part, double q) const
+  {
+    if (count == 0) return 0.0;
+    uint64_t rank = std::max<uint64_t> (1, (uint64_t) std::ceil (q * count));
+    uint64_t seen = 0;
+    for (uint32_t bucket = 0; bucket < ClusterMatrix::delayBuckets; bucket++)
+      {
+        seen += histogram[part][bucket];
+        if (seen >= rank) return std::min (ClusterMatrix::BucketDelay (bucket), max[part]);
+      }
+    return max[part];
+  }
+
+  uint64_t count;
+  double sum[PARTS];
+  double max[PARTS];
+  uint32_t histogram[PARTS][ClusterMatrix::delayBuckets];
+};
+
+/*
+ * UDP echo client whose destination can be changed while it is running.
+ * Every request carries an EchoTimingHeader, so the round trip time of each
+ * echo reply is measured exactly whichever server it was sent to, and is
+ * split into forward, server and return parts when a TimestampedEchoServer
+ * answered.
+ */
+class SteerableEchoClient : public Application
+{
+public:
+  static TypeId GetTypeId (void);
+  SteerableEchoClient ();
+  virtual ~SteerableEchoClient ();
+
+  void SetRemote (Address ip, uint16_t port);
+  Address GetRemote (void) const;
+  const EchoBreakdown &GetBreakdown (void) const;
+  // Wait from the first request to the first reply beyond the steady RTT, false without later replies
+  bool GetRouteDiscovery (double &seconds) const;
+
+protected:
+  virtual void DoDispose (void);
+
+private:
+  virtual void StartApplication (void);
+  virtual void StopApplication (void);
+  void ScheduleTransmit (Time dt);
+  void Send (void);
+  void HandleRead (Ptr<Socket> socket);
+
+  uint32_t m_count;
+  Time m_interval;
+  uint32_t m_size;
+  uint32_t m_sent;
+  uint32_t m_replies;
+  Ptr<Socket> m_socket;
+  Address m_peerAddress;
+  uint16_t m_peerPort;
+  EventId m_sendEvent;
+  EchoBreakdown m_breakdown;
+  Time m_firstSend;
+  double m_firstWait;
+  double m_laterRttSum;
+  double m_lastRtt;
+};
+
+NS_OBJECT_ENSURE_REGISTERED (SteerableEchoClient);
+
+TypeId
+SteerableEchoClient::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("SteerableEchoClient")
+    .SetParent<Application> ()
+    .SetGroupName ("Applications")
+    .AddConstructor<SteerableEchoClient> ()
+    .AddAttribute ("MaxPackets", "The maximum number of packets the application will send",
+                   UintegerValue (100),
+                   MakeUintegerAccessor (&SteerableEchoClient::m_count),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("Interval", "The time to wait between packets",
+                   TimeValue (Seconds (1.0)),
+                   MakeTimeAccessor (&SteerableEchoClient::m_interval),
+                   MakeTimeChecker ())
+    .AddAttribute ("RemoteAddress", "The destination Address of the outbound packets",
+                   AddressValue (),
+                   MakeAddressAccessor (&SteerableEchoClient::m_peerAddress),
+                   MakeAddressChecker ())
+    .AddAttribute ("RemotePort", "The destination port of the outbound packets",
+                   UintegerValue (echoPort),
+                   MakeUintegerAccessor (&SteerableEchoClient::m_peerPort),
+                   MakeUintegerChecker<uint16_t> ())
+    .AddAttribute ("PacketSize", "Size of echo data in outbound packets",
+                   UintegerValue (1024),
+                   MakeUintegerAccessor (&SteerableEchoClient::m_size),
+                   MakeUintegerChecker<uint32_t> (28))
+  ;
+  return tid;
+}
+
+SteerableEchoClient::SteerableEchoClient ()
+  : m_count (0),
+    m_size (1024),
+    m_sent (0),
+    m_replies (0),
+    m_socket (0),
+    m_peerPort (echoPort),
+    m_firstWait (0.0),
+    m_laterRttSum (0.0),
+    m_lastRtt (0.0)
+{
+}
+
+SteerableEchoClient::~SteerableEchoClient ()
+{
+  m_socket = 0;
+}
+
+void
+SteerableEchoClient::SetRemote (Address ip, uint16_t port)
+{
+  m_peerAddress = ip;
+  m_peerPort = port;
+  // UDP sockets may be re-connected at any time, this only changes the default peer
+  if (m_socket != 0)
+    {
+      m_socket->Connect (InetSocketAddress (Ipv4Address::ConvertFrom (m_peerAddress), m_peerPort));
+    }
+}
+
+Address
+SteerableEchoClient::GetRemote (void) const
+{
+  return m_peerAddress;
+}
+
+bool
+SteerableEchoClient::GetRouteDiscovery (double &seconds) const
+{
+  if (m_replies < 2) return false;
+  seconds = m_firstWait - m_laterRttSum / (m_replies - 1);
+  return true;
+}
+
+const EchoBreakdown &
+SteerableEchoClient::GetBreakdown (void) const
+{
+  return m_breakdown;
+}
+
+void
+SteerableEchoClient::DoDispose (void)
+{
+  Application::DoDispose ();
+}
+
+void
+SteerableEchoClient::StartApplication (void)
+{
+  if (m_socket == 0)
+    {
+      TypeId tid = TypeId::LookupByName ("ns3::UdpSocketFactory");
+      m_socket = Socket::CreateSocket (GetNode (), tid);
+      m_socket->Bind ();
+      m_socket->Connect (InetSocketAddress (Ipv4Address::ConvertFrom (m_peerAddress), m_peerPort));
+    }
+  m_socket->SetRecvCallback (MakeCallback (&SteerableEchoClient::HandleRead, this));
+  ScheduleTransmit (Seconds (0.));
+}
+
+void
+SteerableEchoClient::StopApplication (void)
+{
+  if (m_socket != 0)
+    {
+      m_socket->Close ();
+      m_socket->SetRecvCallback (MakeNullCallback<void, Ptr<Socket> > ());
+      m_socket = 0;
+    }
+  Simulator::Cancel (m_sendEvent);
+}
+
+void
+SteerableEchoClient::ScheduleTransmit (Time dt)
+{
+  m_sendEvent = Simulator::Schedule (dt, &SteerableEchoClient::Send, this);
+}
+
+void
+SteerableEchoClient::Send (void)
+{
+  EchoTimingHeader timing;
+  timing.seq = m_sent;
+  timing.clientTx = Simulator::Now ();
+  if (m_sent == 0)
+    {
+      m_firstSend = Simulator::Now ();
+    }
+  Ptr<Packet> p = Create<Packet> (m_size - timing.GetSerializedSize ());
+  p->AddHeader (timing);
+  m_socket->Send (p);
+  ++m_sent;
+  ++global_PacketsSent;
+  reward_engine.OnSent ();
+
+  if (m_sent < m_count)
+    {
+      ScheduleTransmit (m_interval);
+    }
+}
+
+void
+SteerableEchoClient::HandleRead (Ptr<Socket> socket)
+{
+  Ptr<Packet> packet;
+  Address from;
+  while ((packet = socket->RecvFrom (from)))
+    {
+      EchoTimingHeader timing;
+      packet->RemoveHeader (timing);
+      double rtt = (Simulator::Now () - timing.clientTx).GetSeconds ();
+      ++global_PacketsReceived;
+      OnLatencySample (rtt, packet->GetSize () + timing.GetSerializedSize (), GetNode ()->GetId (), timing.clientTx);
+      OnEchoReply (m_replies == 0, rtt);
+      std::map<uint32_t, uint32_t>::const_iterator src =
+        address_cluster.find (GetNode ()->GetObject<Ipv4> ()->GetAddress (1, 0).GetLocal ().Get ());
+      std::map<uint32_t, uint32_t>::const_iterator dst =
+        address_cluster.find (InetSocketAddress::ConvertFrom (from).GetIpv4 ().Get ());
+      if (src != address_cluster.end () && dst != address_cluster.end ())
+        {
+          cluster_matrix.OnReceived (src->second, dst->second, packet->GetSize () + timing.GetSerializedSize (),
+                                     rtt, std::abs (rtt - m_lastRtt), m_replies == 0);
+        }
+      m_lastRtt = rtt;
+      if (m_replies == 0)
+        {
+          m_firstWait = (Simulator::Now () - m_firstSend).GetSeconds ();
+        }
+      else
+        {
+          m_laterRttSum += rtt;
+        }
+      ++m_replies;
+      if (!timing.serverTx.IsZero ())
+        {
+          m_breakdown.Add (timing, Simulator::Now ());
+        }
+      NS_LOG_INFO ("node " << GetNode ()->GetId () << " echo " << timing.seq
+                   << " from " << InetSocketAddress::ConvertFrom (from).GetIpv4 ()
+                   << " rtt " << rtt << "s");
+    }
+}
+
+std::vector < std::vector < Ptr<SteerableEchoClient> > > steerable_clients;
+double echo_processing_time = 0.0;   // seconds the echo servers hold each reply
+
+// Mean and p99 of the three parts of the echo round trip, per client and per client cluster
+void ReportEchoBreakdown(void)
+{
+  for (uint32_t cluster = 0; cluster < steerable_clients.size (); cluster++)
+    {
+      if (steerable_clients[cluster].empty ()) continue;
+      EchoBreakdown total;
+      for (const auto &client : steerable_clients[cluster])
+        {
+          const EchoBreakdown &breakdown = client->GetBreakdown ();
+          total.Merge (breakdown);
+          NS_LOG_INFO ("node " << client->GetNode ()->GetId () << " forward " << breakdown.Mean (EchoBreakdown::FORWARD)
+                       << "s server " << breakdown.Mean (EchoBreakdown::PROCESSING)
+                       << "s return " << breakdown.Mean (EchoBreakdown::RETURN) << "s");
+        }
+      NS_LOG_UNCOND ("Cluster " << cluster << " echo (" << total.count << " replies): forward mean "
+                     << total.Mean (EchoBreakdown::FORWARD) << "s p99 " << total.Percentile (EchoBreakdown::FORWARD, 0.99)
+                     << "s, server mean " << total.Mean (EchoBreakdown::PROCESSING) << "s p99 " << total.Percentile (EchoBreakdown::PROCESSING, 0.99)
+                     << "s, return mean " << total.Mean (EchoBreakdown::RETURN) << "s p99 " << total.Percentile (EchoBreakdown::RETURN, 0.99) << "s");
+    }
+}
+
+/*
+ * Echo response cache run by a cluster head. It sits first in the head's
+ * Ipv4ListRouting and only looks at forwarded UDP packets:
+ *   - a reply leaving a cached port is stored, keyed by (server, port, size),
+ *     together with how long the head waited for it;
+ *   - a request to a cached port whose key is present and younger than Ttl
+ *     is answered by the head itself, in the name of the server, and consumed;
+ *   - anything else is left to the next routing protocol.
+ * Capacity bounds the cache, the least recently used entry goes first.
+ * Requests of the same size to the same server are identical apart from
+ * their EchoTimingHeader, which the head rewrites for each answer.
+ */
+class EchoResponseCache : public Ipv4RoutingProtocol
+{
+public:
+  static TypeId GetTypeId (void);
+  EchoResponseCache ();
+
+  virtual Ptr<Ipv4Route> RouteOutput (Ptr<Packet> p, const Ipv4Header &header, Ptr<NetDevice> oif,
+                                      Socket::SocketErrno &sockerr);
+  virtual bool RouteInput (Ptr<const Packet> p, const Ipv4Header &header, Ptr<const NetDevice> idev,
+                           UnicastForwardCallback ucb, MulticastForwardCallback mcb,
+                           LocalDeliverCallback lcb, ErrorCallback ecb);
+  virtual void NotifyInterfaceUp (uint32_t interface) {}
+  virtual void NotifyInterfaceDown (uint32_t interface) {}
+  virtual void NotifyAddAddress (uint32_t interface, Ipv4InterfaceAddress address) {}
+  virtual void NotifyRemoveAddress (uint32_t interface, Ipv4InterfaceAddress address) {}
+  virtual void SetIpv4 (Ptr<Ipv4> ipv4);
+  virtual void PrintRoutingTable (Ptr<OutputStreamWrapper> stream, Time::Unit unit = Time::S) const;
+
+  uint64_t GetHits (void) const;
+  uint64_t GetMisses (void) const;
+  double GetLatencySaved (void) const;   // seconds, sum of the fetch times of the hits
+
+protected:
+  virtual void DoDispose (void);
+
+private:
+  struct Entry
+  {
+    Ptr<Packet> payload;   // reply without UDP and timing headers
+    Time stored;
+    Time fetchTime;
+    std::list<uint64_t>::iterator recency;
+  };
+  static uint64_t Key (Ipv4Address server, uint16_t port, uint32_t size);
+  void Answer (const Entry &entry, const Ipv4Header &request, const UdpHeader &udp, const EchoTimingHeader &timing);
+
+  uint16_t m_port;
+  uint32_t m_capacity;
+  Time m_ttl;
+  Ptr<Ipv4> m_ipv4;
+  std::map<uint64_t, Entry> m_entries;
+  std::list<uint64_t> m_recency;        // most recently used first
+  std::map<uint64_t, Time> m_inFlight;  // first forwarded miss per key
+  uint64_t m_hits;
+  uint64_t m_misses;
+  double m_latencySaved;
+};
+
+NS_OBJECT_ENSURE_REGISTERED (EchoResponseCache);
+
+TypeId
+EchoResponseCache::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("EchoResponseCache")
+    .SetParent<Ipv4RoutingProtocol> ()
+    .SetGroupName ("Internet")
+    .AddConstructor<EchoResponseCache> ()
+    .AddAttribute ("Port", "Server port whose requests are cached",
+                   UintegerValue (echoPort),
+                   MakeUintegerAccessor (&EchoResponseCache::m_port),
+                   MakeUintegerChecker<uint16_t> ())
+    .AddAttribute ("Capacity", "Entries kept before the least recently used is evicted",
+                   UintegerValue (16),
+                   MakeUintegerAccessor (&EchoResponseCache::m_capacity),
+                   MakeUintegerChecker<uint32_t> (1))
+    .AddAttribute ("Ttl", "Age after which an entry is no longer served",
+                   TimeValue (Seconds (5.0)),
+                   MakeTimeAccessor (&EchoResponseCache::m_ttl),
+                   MakeTimeChecker ())
+  ;
+  return tid;
+}
+
+EchoResponseCache::EchoResponseCache ()
+  : m_port (echoPort),
+    m_capacity (16),
+    m_hits (0),
+    m_misses (0),
+    m_latencySaved (0.0)
+{
+}
+
+void
+EchoResponseCache::DoDispose (void)
+{
+  m_entries.clear ();
+  m_ipv4 = 0;
+  Ipv4RoutingProtocol::DoDispose ();
+}
+
+void
+EchoResponseCache::SetIpv4 (Ptr<Ipv4> ipv4)
+{
+  m_ipv4 = ipv4;
+}
+
+void
+EchoResponseCache::PrintRoutingTable (Ptr<OutputStreamWrapper> stream, Time::Unit unit) const
+{
+  *stream->GetStream () << "EchoResponseCache port " << m_port << ", " << m_entries.size () << " entries" << std::endl;
+}
+
+Ptr<Ipv4Route>
+EchoResponseCache::RouteOutput (Ptr<Packet> p, const Ipv4Header &header, Ptr<NetDevice> oif,
+                                Socket::SocketErrno &sockerr)
+{
+  // Never routes, the rest of the list does
+  sockerr = Socket::ERROR_NOROUTETOHOST;
+  return 0;
+}
+
+uint64_t
+EchoResponseCache::Key (Ipv4Address server, uint16_t port, uint32_t size)
+{
+  return ((uint64_t) server.Get () << 32) | ((uint64_t) port << 16) | (size & 0xffff);
+}
+
+bool
+EchoResponseCache::RouteInput (Ptr<const Packet> p, const Ipv4Header &header, Ptr<const NetDevice> idev,
+                               UnicastForwardCallback ucb, MulticastForwardCallback mcb,
+                               LocalDeliverCallback lcb, ErrorCallback ecb)
+{
+  EchoTimingHeader timing;
+  UdpHeader udp;
+  if (header.GetProtocol () != UdpL4Protocol::PROT_NUMBER
+      || p->GetSize () < udp.GetSerializedSize () + timing.GetSerializedSize ()
+      || m_ipv4->IsDestinationAddress (header.GetDestination (), m_ipv4->GetInterfaceForDevice (idev)))
+    {
+      return false;
+    }
+  Ptr<Packet> packet = p->Copy ();
+  packet->RemoveHeader (udp);
+
+  if (udp.GetSourcePort () == m_port)
+    {
+      // A reply on its way back, remember it
+      uint64_t key = Key (header.GetSource (), m_port, packet->GetSize ());
+      packet->RemoveHeader (timing);
+      std::map<uint64_t, Entry>::iterator entry = m_entries.find (key);
+      if (entry != m_entries.end ())
+        {
+          m_recency.erase (entry->second.recency);
+          m_entries.erase (entry);
+        }
+      else if (m_entries.size () >= m_capacity)
+        {
+          m_entries.erase (m_recency.back ());
+          m_recency.pop_back ();
+        }
+      std::map<uint64_t, Time>::iterator forwarded = m_inFlight.find (key);
+      Time fetchTime = (forwarded != m_inFlight.end ()) ? Simulator::Now () - forwarded->second : Time (0);
+      if (forwarded != m_inFlight.end ()) m_inFlight.erase (forwarded);
+      m_recency.push_front (key);
+      Entry stored = {packet, Simulator::Now (), fetchTime, m_recency.begin ()};
+      m_entries[key] = stored;
+      return false;
+    }
+
+  if (udp.GetDestinationPort () != m_port)
+    {
+      return false;
+    }
+  uint64_t key = Key (header.GetDestination (), m_port, packet->GetSize ());
+  std::map<uint64_t, Entry>::iterator entry = m_entries.find (key);
+  if (entry == m_entries.end () || Simulator::Now () - entry->second.stored > m_ttl)
+    {
+      m_misses ++;
+      if (m_inFlight.find (key) == m_inFlight.end ()) m_inFlight[key] = Simulator::Now ();
+      return false;
+    }
+  m_recency.splice (m_recency.begin (), m_recency, entry->second.recency);
+  packet->RemoveHeader (timing);
+  Answer (entry->second, header, udp, timing);
+  m_hits ++;
+  m_latencySaved += entry->second.fetchTime.GetSeconds ();
+  return true;
+}
+
+void
+EchoResponseCache::Answer (const Entry &entry, const Ipv4Header &request, const UdpHeader &udp, const EchoTimingHeader &timing)
+{
+  EchoTimingHeader reply = timing;
+  reply.serverRx = Simulator::Now ();
+  reply.serverTx = Simulator::Now ();
+  Ptr<Packet> packet = entry.payload->Copy ();
+  packet->AddHeader (reply);
+  UdpHeader replyUdp;
+  replyUdp.SetSourcePort (udp.GetDestinationPort ());
+  replyUdp.SetDestinationPort (udp.GetSourcePort ());
+  packet->AddHeader (replyUdp);
+  Ptr<Ipv4L3Protocol> l3 = m_ipv4->GetObject<Ipv4L3Protocol> ();
+  l3->Send (packet, request.GetDestination (), request.GetSource (), UdpL4Protocol::PROT_NUMBER, 0);
+}
+
+uint64_t
+EchoResponseCache::GetHits (void) const
+{
+  return m_hits;
+}
+
+uint64_t
+EchoResponseCache::GetMisses (void) const
+{
+  return m_misses;
+}
+
+double
+EchoResponseCache::GetLatencySaved (void) const
+{
+  return m_latencySaved;
+}
+
+bool head_cache = false;
+uint32_t head_cache_capacity = 16;
+double head_cache_ttl = 5.0;   // seconds
+std::vector < Ptr<EchoResponseCache> > head_caches;
+
+// Puts a cache in front of the routing of every head
+void InstallHeadCaches(const std::vector<NodeContainer> &heads)
+{
+  for (const auto &head : heads)
+    {
+      Ptr<Ipv4> ipv4 = head.Get (0)->GetObject<Ipv4> ();
+      Ptr<Ipv4ListRouting> list = DynamicCast<Ipv4ListRouting> (ipv4->GetRoutingProtocol ());
+      NS_ABORT_MSG_IF (!list, "Head caches need list routing on node " << head.Get (0)->GetId ());
+      Ptr<EchoResponseCache> cache = CreateObject<EchoResponseCache> ();
+      cache->SetAttribute ("Capacity", UintegerValue (head_cache_capacity));
+      cache->SetAttribute ("Ttl", TimeValue (Seconds (head_cache_ttl)));
+      cache->SetIpv4 (ipv4);
+      list->AddRoutingProtocol (cache, 1000);
+      head_caches.push_back (cache);
+    }
+}
+
+void ReportHeadCaches(void)
+{
+  for (uint32_t cluster = 0; cluster < head_caches.size (); cluster++)
+    {
+      Ptr<EchoResponseCache> cache = head_caches[cluster];
+      uint64_t lookups = cache->GetHits () + cache->GetMisses ();
+      if (lookups == 0) continue;
+      NS_LOG_UNCOND ("Head " << cluster << " cache: " << cache->GetHits () << "/" << lookups << " hits ("
+                     << 100.0 * cache->GetHits () / lookups << "%), " << cache->GetLatencySaved () << "s latency saved");
+    }
+}
+
+/*
+ * High rate UDP traffic generator. Pattern selects the send process:
+ *   cbr      one packet every PacketSize/DataRate
+ *   poisson  exponential gaps with the same mean
+ *   onoff    cbr during exponential OnTime periods, silent for exponential OffTime
+ *   bursty   BurstSize packets back to back in one event, bursts spaced to keep DataRate
+ * Packet sizes are PacketSize, or uniform in [PacketSize, MaxPacketSize].
+ * Payloads come from a pool of one template packet per size: every send is a
+ * copy-on-write copy of its template plus a SeqTsHeader, so no payload bytes
+ * are allocated or filled per packet.
+ */
+class TrafficGenerator : public Application
+{
+public:
+  static TypeId GetTypeId (void);
+  TrafficGenerator ();
+  virtual ~TrafficGenerator ();
+
+  uint64_t GetPacketsSent (void) const;
+  uint64_t GetBytesSent (void) const;
+  double GetAchievedRate (void) const;  // bits per second between first and last send
+  void SetRemote (Address ip);
+  Address GetRemote (void) const;
+
+protected:
+  virtual void DoDispose (void);
+
+private:
+  virtual void StartApplication (void);
+  virtual void StopApplication (void);
+  void ScheduleNext (void);
+  void SendBurst (void);
+  void SendOne (void);
+  void StartOff (void);
+  uint32_t NextSize (void);
+  Time Gap (uint32_t bytes) const;
+
+  Address m_peerAddress;
+  uint16_t m_peerPort;
+  std::string m_pattern;
+  DataRate m_rate;
+  uint32_t m_size;
+  uint32_t m_maxSize;
+  uint32_t m_burstSize;
+  Time m_onTime;
+  Time m_offTime;
+  uint64_t m_maxPackets;
+
+  Ptr<Socket> m_socket;
+  std::vector< Ptr<Packet> > m_pool;
+  Ptr<UniformRandomVariable> m_uniform;
+  Ptr<ExponentialRandomVariable> m_exponential;
+  EventId m_sendEvent;
+  Time m_onUntil;
+  uint32_t m_seq;
+  uint64_t m_packetsSent;
+  uint64_t m_bytesSent;
+  Time m_firstSend;
+  Time m_lastSend;
+};
+
+NS_OBJECT_ENSURE_REGISTERED (TrafficGenerator);
+
+TypeId
+TrafficGenerator::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("TrafficGenerator")
+    .SetParent<Application> ()
+    .SetGroupName ("Applications")
+    .AddConstructor<TrafficGenerator> ()
+    .AddAttribute ("RemoteAddress", "The destination Address of the outbound packets",
+                   AddressValue (),
+                   MakeAddressAccessor (&TrafficGenerator::m_peerAddress),
+                   MakeAddressChecker ())
+    .AddAttribute ("RemotePort", "The destination port of the outbound packets",
+                   UintegerValue (5000),
+                   MakeUintegerAccessor (&TrafficGenerator::m_peerPort),
+                   MakeUintegerChecker<uint16_t> ())
+    .AddAttribute ("Pattern", "cbr, poisson, onoff or bursty",
+                   StringValue ("cbr"),
+                   MakeStringAccessor (&TrafficGenerator::m_pattern),
+                   MakeStringChecker ())
+    .AddAttribute ("DataRate", "Mean sending rate",
+                   DataRateValue (DataRate ("1Mbps")),
+                   MakeDataRateAccessor (&TrafficGenerator::m_rate),
+                   MakeDataRateChecker ())
+    .AddAttribute ("PacketSize", "Size of the packets, or smallest size when MaxPacketSize is larger",
+                   UintegerValue (1024),
+                   MakeUintegerAccessor (&TrafficGenerator::m_size),
+                   MakeUintegerChecker<uint32_t> (12))
+    .AddAttribute ("MaxPacketSize", "Largest packet size, 0 sends PacketSize only",
+                   UintegerValue (0),
+                   MakeUintegerAccessor (&TrafficGenerator::m_maxSize),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("BurstSize", "Packets per burst of the bursty pattern",
+                   UintegerValue (16),
+                   MakeUintegerAccessor (&TrafficGenerator::m_burstSize),
+                   MakeUintegerChecker<uint32_t> (1))
+    .AddAttribute ("OnTime", "Mean length of the on periods of the onoff pattern",
+                   TimeValue (Seconds (1.0)),
+                   MakeTimeAccessor (&TrafficGenerator::m_onTime),
+                   MakeTimeChecker ())
+    .AddAttribute ("OffTime", "Mean length of the off periods of the onoff pattern",
+                   TimeValue (Seconds (1.0)),
+                   MakeTimeAccessor (&TrafficGenerator::m_offTime),
+                   MakeTimeChecker ())
+    .AddAttribute ("MaxPackets", "Packets to send, 0 sends until the application stops",
+                   UintegerValue (0),
+                   MakeUintegerAccessor (&TrafficGenerator::m_maxPackets),
+                   MakeUintegerChecker<uint64_t> ())
+  ;
+  return tid;
+}
+
+TrafficGenerator::TrafficGenerator ()
+  : m_peerPort (5000),
+    m_size (1024),
+    m_maxSize (0),
+    m_burstSize (16),
+    m_maxPackets (0),
+    m_socket (0),
+    m_seq (0),
+    m_packetsSent (0),
+    m_bytesSent (0)
+{
+  m_uniform = CreateObject<UniformRandomVariable> ();
+  m_exponential = CreateObject<ExponentialRandomVariable> ();
+}
+
+TrafficGenerator::~TrafficGenerator ()
+{
+  m_socket = 0;
+}
+
+void
+TrafficGenerator::DoDispose (void)
+{
+  m_pool.clear ();
+  Application::DoDispose ();
+}
+
+uint64_t
+TrafficGenerator::GetPacketsSent (void) const
+{
+  return m_packetsSent;
+}
+
+uint64_t
+TrafficGenerator::GetBytesSent (void) const
+{
+  return m_bytesSent;
+}
+
+double
+TrafficGenerator::GetAchievedRate (void) const
+{
+  double elapsed = (m_lastSend - m_firstSend).GetSeconds ();
+  return elapsed > 0 ? m_bytesSent * 8.0 / elapsed : 0.0;
+}
+
+void
+TrafficGenerator::SetRemote (Address ip)
+{
+  m_peerAddress = ip;
+  if (m_socket != 0)
+    {
+      m_socket->Connect (InetSocketAddress (Ipv4Address::ConvertFrom (m_peerAddress), m_peerPort));
+    }
+}
+
+Address
+TrafficGenerator::GetRemote (void) const
+{
+  return m_peerAddress;
+}
+
+void
+TrafficGenerator::StartApplication (void)
+{
+  if (m_pattern != "cbr" && m_pattern != "poisson" && m_pattern != "onoff" && m_pattern != "bursty")
+    {
+      NS_FATAL_ERROR ("Unknown traffic pattern " << m_pattern);
+    }
+  if (m_socket == 0)
+    {
+      TypeId tid = TypeId::LookupByName ("ns3::UdpSocketFactory");
+      m_socket = Socket::CreateSocket (GetNode (), tid);
+      m_socket->Bind ();
+      m_socket->Connect (InetSocketAddress (Ipv4Address::ConvertFrom (m_peerAddress), m_peerPort));
+    }
+
+  // One template per size, the payload itself is a zero filled virtual area
+  SeqTsHeader seqTs;
+  uint32_t largest = std::max (m_size, m_maxSize);
+  m_pool.assign (largest - m_size + 1, Ptr<Packet> ());
+  for (uint32_t size = m_size; size <= largest; size++)
+    {
+      m_pool[size - m_size] = Create<Packet> (size - seqTs.GetSerializedSize ());
+    }
+
+  // Only onoff has off periods; Now () + Time::Max () would overflow
+  m_onUntil = m_pattern == "onoff" ? Simulator::Now () + Seconds (m_exponential->GetValue (m_onTime.GetSeconds (), 0)) : Time::Max ();
+  m_sendEvent = Simulator::ScheduleNow (&TrafficGenerator::SendBurst, this);
+}
+
+void
+TrafficGenerator::StopApplication (void)
+{
+  Simulator::Cancel (m_sendEvent);
+  if (m_socket != 0)
+    {
+      m_socket->Close ();
+      m_socket = 0;
+    }
+  NS_LOG_INFO ("TrafficGenerator on node " << GetNode ()->GetId () << " sent " << m_packetsSent
+               << " packets, achieved " << GetAchievedRate () / 1e6 << " Mbps of " << m_rate.GetBitRate () / 1e6);
+}
+
+uint32_t
+TrafficGenerator::NextSize (void)
+{
+  if (m_maxSize <= m_size) return m_size;
+  return m_uniform->GetInteger (m_size, m_maxSize);
+}
+
+Time
+TrafficGenerator::Gap (uint32_t bytes) const
+{
+  return m_rate.CalculateBytesTxTime (bytes);
+}
+
+void
+TrafficGenerator::SendOne (void)
+{
+  uint32_t size = NextSize ();
+  SeqTsHeader seqTs;
+  seqTs.SetSeq (m_seq++);
+  Ptr<Packet> p = m_pool[size - m_size]->Copy ();
+  p->AddHeader (seqTs);
+  m_socket->Send (p);
+
+  if (m_packetsSent == 0) m_firstSend = Simulator::Now ();
+  m_lastSend = Simulator::Now ();
+  m_packetsSent ++;
+  m_bytesSent += size;
+  ++global_PacketsSent;
+}
+
+void
+TrafficGenerator::SendBurst (void)
+{
+  if (Simulator::Now () >= m_onUntil)
+    {
+      StartOff ();
+      return;
+    }
+  uint32_t count = (m_pattern == "bursty") ? m_burstSize : 1;
+  for (uint32_t i = 0; i < count; i++)
+    {
+      if (m_maxPackets > 0 && m_packetsSent >= m_maxPackets) return;
+      SendOne ();
+    }
+  ScheduleNext ();
+}
+
+void
+TrafficGenerator::ScheduleNext (void)
+{
+  uint32_t meanSize = (m_maxSize > m_size) ? (m_size + m_maxSize) / 2 : m_size;
+  Time gap = Gap (meanSize);
+  if (m_pattern == "poisson")
+    {
+      gap = Seconds (m_exponential->GetValue (gap.GetSeconds (), 0));
+    }
+  else if (m_pattern == "bursty")
+    {
+      gap = gap * m_burstSize;
+    }
+  m_sendEvent = Simulator::Schedule (gap, &TrafficGenerator::SendBurst, this);
+}
+
+void
+TrafficGenerator::StartOff (void)
+{
+  Time off = Seconds (m_exponential->GetValue (m_offTime.GetSeconds (), 0));
+  m_onUntil = Simulator::Now () + off + Seconds (m_exponential->GetValue (m_onTime.GetSeconds (), 0));
+  m_sendEvent = Simulator::Schedule (off, &TrafficGenerator::SendBurst, this);
+}
+
+// "echo" runs the steerable echo clients, "generator" the high rate traffic generators
+std::string traffic_mode = "echo";
+std::string traffic_pattern = "cbr";
+std::string traffic_rate = "1Mbps";
+uint32_t traffic_packet_size = 1024;
+uint32_t traffic_max_packet_size = 0;
+const uint16_t generatorPort = 5000;
+std::string traffic_matrix = "fanin";
+std::vector < Ptr<TrafficGenerator> > traffic_generators;
+
+// One generator of the traffic matrix, weight scales the configured rate
+struct TrafficFlow
+{
+  uint32_t srcCluster;
+  uint32_t srcNode;
+  uint32_t dstCluster;
+  uint32_t dstNode;
+  double weight;
+};
+
+/*
+ * UDP sink with constant cost per packet. Every readable event drains the
+ * socket completely. Flows are keyed by sender address and port in a fixed
+ * open addressed table of MaxFlows slots probed at most maxProbes times;
+ * flows that find no slot within the probes share one overflow slot, so a
+ * full table costs the same per packet as an empty one. Each flow keeps counters, sequence gap losses and a log
+ * scaled one way delay histogram read from the SeqTsHeader of the packet,
+ * nothing is allocated or logged on the receive path.
+ */
+class FlowSink : public Application
+{
+public:
+  static const uint32_t delayBuckets = ClusterMatrix::delayBuckets;
+  struct FlowStats
+  {
+    Ipv4Address source;
+    uint16_t sourcePort;
+    uint32_t sourceCluster;   // home cluster of the sender, resolved once per flow
+    bool used;
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t lost;
+    uint32_t nextSeq;
+    double delaySum;
+    double lastDelay;
+    Time firstRx;
+    Time lastRx;
+    uint32_t histogram[delayBuckets];
+  };
+
+  static TypeId GetTypeId (void);
+  FlowSink ();
+  virtual ~FlowSink ();
+
+  uint32_t GetFlowCount (void) const;               // flows in the table, not counting overflow
+  uint32_t GetSlotCount (void) const;
+  const FlowStats &GetFlow (uint32_t index) const;  // index < GetSlotCount, overflow slot last
+  uint64_t GetPacketsReceived (void) const;
+  uint64_t GetBytesReceived (void) const;
+  static double GetBucketDelay (uint32_t bucket);  // upper edge in seconds
+  void Dump (std::ostream &os) const;
+
+protected:
+  virtual void DoDispose (void);
+
+private:
+  virtual void StartApplication (void);
+  virtual void StopApplication (void);
+  void HandleRead (Ptr<Socket> socket);
+  static const uint32_t maxProbes = 16;
+  FlowStats &Lookup (const InetSocketAddress &from);
+
+  uint16_t m_port;
+  uint32_t m_maxFlows;
+  uint32_t m_cluster;
+  Ptr<Socket> m_socket;
+  std::vector<FlowStats> m_flows;   // m_maxFlows slots plus the overflow slot
+  uint32_t m_flowCount;
+  uint64_t m_packets;
+  uint64_t m_bytes;
+};
+
+NS_OBJECT_ENSURE_REGISTERED (FlowSink);
+
+TypeId
+FlowSink::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("FlowSink")
+    .SetParent<Application> ()
+    .SetGroupName ("Applications")
+    .AddConstructor<FlowSink> ()
+    .AddAttribute ("Port", "Port on which we listen for incoming packets.",
+                   UintegerValue (5000),
+                   MakeUintegerAccessor (&FlowSink::m_port),
+                   MakeUintegerChecker<uint16_t> ())
+    .AddAttribute ("MaxFlows", "Flows tracked individually, the rest share one slot",
+                   UintegerValue (64),
+                   MakeUintegerAccessor (&FlowSink::m_maxFlows),
+                   MakeUintegerChecker<uint32_t> (1))
+    .AddAttribute ("Cluster", "Home cluster of the sink node, the destination of the cluster matrix",
+                   UintegerValue (0),
+                   MakeUintegerAccessor (&FlowSink::m_cluster),
+                   MakeUintegerChecker<uint32_t> ())
+  ;
+  return tid;
+}
+
+FlowSink::FlowSink ()
+  : m_port (5000),
+    m_maxFlows (64),
+    m_cluster (0),
+    m_socket (0),
+    m_flowCount (0),
+    m_packets (0),
+    m_bytes (0)
+{
+}
+
+FlowSink::~FlowSink ()
+{
+  m_socket = 0;
+}
+
+void
+FlowSink::DoDispose (void)
+{
+  m_flows.clear ();
+  Application::DoDispose ();
+}
+
+void
+FlowSink::StartApplication (void)
+{
+  FlowStats empty = {};
+  empty.source = Ipv4Address::GetZero ();
+  empty.firstRx = Seconds (0);
+  empty.lastRx = Seconds (0);
+  m_flows.assign (m_maxFlows + 1, empty);
+  m_flows[m_maxFlows].used = true;
+  m_flows[m_maxFlows].sourceCluster = UINT32_MAX;
+  m_flowCount = 0;
+
+  if (m_socket == 0)
+    {
+      TypeId tid = TypeId::LookupByName ("ns3::UdpSocketFactory");
+      m_socket = Socket::CreateSocket (GetNode (), tid);
+      if (m_socket->Bind (InetSocketAddress (Ipv4Address::GetAny (), m_port)) == -1)
+        {
+          NS_FATAL_ERROR ("Failed to bind socket");
+        }
+    }
+  m_socket->SetRecvCallback (MakeCallback (&FlowSink::HandleRead, this));
+}
+
+void
+FlowSink::StopApplication (void)
+{
+  if (m_socket != 0)
+    {
+      m_socket->Close ();
+      m_socket->SetRecvCallback (MakeNullCallback<void, Ptr<Socket> > ());
+    }
+}
+
+FlowSink::FlowStats &
+FlowSink::Lookup (const InetSocketAddress &from)
+{
+  Ipv4Address source = from.GetIpv4 ();
+  uint16_t sourcePort = from.GetPort ();
+  uint32_t slot = (source.Get () * 2654435761u ^ sourcePort) % m_maxFlows;
+  uint32_t probes = m_maxFlows < maxProbes ? m_maxFlows : maxProbes;
+  for (uint32_t probe = 0; probe < probes; probe++)
+    {
+      FlowStats &flow = m_flows[slot];
+      if (!flow.used)
+        {
+          flow.used = true;
+          flow.source = source;
+          flow.sourcePort = sourcePort;
+          std::map<uint32_t, uint32_t>::const_iterator home = address_cluster.find (source.Get ());
+          flow.sourceCluster = (home == address_cluster.end ()) ? UINT32_MAX : home->second;
+          m_flowCount ++;
+          return flow;
+        }
+      if (flow.source == source && flow.sourcePort == sourcePort)
+        {
+          return flow;
+        }
+      slot = (slot + 1) % m_maxFlows;
+    }
+  return m_flows[m_maxFlows];
+}
+
+void
+FlowSink::HandleRead (Ptr<Socket> socket)
+{
+  Ptr<Packet> packet;
+  Address from;
+  Time now = Simulator::Now ();
+  while ((packet = socket->RecvFrom (from)))
+    {
+      uint32_t size = packet->GetSize ();
+      m_packets ++;
+      m_bytes += size;
+      if (!InetSocketAddress::IsMatchingType (from)) continue;
+
+      FlowStats &flow = Lookup (InetSocketAddress::ConvertFrom (from));
+      if (flow.packets == 0) flow.firstRx = now;
+      flow.lastRx = now;
+      flow.packets ++;
+      flow.bytes += size;
+
+      SeqTsHeader seqTs;
+      if (size < seqTs.GetSerializedSize ()) continue;
+      packet->RemoveHeader (seqTs);
+      uint32_t seq = seqTs.GetSeq ();
+      int64_t lost = 0;
+      if (seq >= flow.nextSeq)
+        {
+          lost = seq - flow.nextSeq;
+          flow.nextSeq = seq + 1;
+        }
+      else if (flow.lost > 0)
+        {
+          lost = -1;   // late arrival of a packet counted lost
+        }
+      flow.lost += lost;
+
+      double delay = (now - seqTs.GetTs ()).GetSeconds ();
+      double jitter = flow.packets > 1 ? std::abs (delay - flow.lastDelay) : 0.0;
+      flow.lastDelay = delay;
+      flow.delaySum += delay;
+      flow.histogram[ClusterMatrix::DelayBucket (delay)] ++;
+      convergence_monitor.OnReceived (delay, size, false);
+      OnMetricsSample (delay, size);
+
+      if (flow.sourceCluster != UINT32_MAX)
+        {
+          cluster_matrix.OnReceived (flow.sourceCluster, m_cluster, size, delay, jitter, flow.packets == 1);
+          if (lost != 0) cluster_matrix.OnLost (flow.sourceCluster, m_cluster, lost);
+        }
+    }
+}
+
+uint32_t
+FlowSink::GetFlowCount (void) const
+{
+  return m_flowCount;
+}
+
+uint32_t
+FlowSink::GetSlotCount (void) const
+{
+  return m_flows.size ();
+}
+
+const FlowSink::FlowStats &
+FlowSink::GetFlow (uint32_t index) const
+{
+  NS_ABORT_MSG_IF (index >= m_flows.size (), "FlowSink has no flow slot " << index);
+  return m_flows[index];
+}
+
+uint64_t
+FlowSink::GetPacketsReceived (void) const
+{
+  return m_packets;
+}
+
+uint64_t
+FlowSink::GetBytesReceived (void) const
+{
+  return m_bytes;
+}
+
+double
+FlowSink::GetBucketDelay (uint32_t bucket)
+{
+  return ClusterMatrix::BucketDelay (bucket);
+}
+
+// One CSV row per active flow: time,node,source,port,packets,bytes,lost,meanDelay,then the histogram
+void
+FlowSink::Dump (std::ostream &os) const
+{
+  for (uint32_t i = 0; i < m_flows.size (); i++)
+    {
+      const FlowStats &flow = m_flows[i];
+      if (flow.packets == 0) continue;
+      os << Simulator::Now ().GetSeconds () << "," << GetNode ()->GetId () << ",";
+      if (i == m_maxFlows) os << "other,0";
+      else os << flow.source << "," << flow.sourcePort;
+      os << "," << flow.packets << "," << flow.bytes << "," << flow.lost
+         << "," << flow.delaySum / flow.packets;
+      for (uint32_t b = 0; b < delayBuckets; b++)
+        {
+          os << "," << flow.histogram[b];
+        }
+      os << std::endl;
+    }
+}
+
+std::vector < Ptr<FlowSink> > flow_sinks;
+std::string sink_dump_file = "";
+double sink_dump_interval = 1.0;
+std::ofstream sink_dump;
+
+void DumpFlowSinks ()
+{
+  for (const auto &sink : flow_sinks)
+    {
+      sink->Dump (sink_dump);
+    }
+  sink_dump.flush ();
+  Simulator::Schedule (Seconds (sink_dump_interval), &DumpFlowSinks);
+}
+
+/*
+ * Batched random walk. Positions, velocities and bounds of every mobile node
+ * live in contiguous arrays that one periodic tick advances with a branch-free
+ * loop the compiler can vectorize, instead of one RandomWalk2dMobilityModel
+ * object and one walk event per node. All nodes redraw speed and direction
+ * together every direction interval. Positions are exact at tick boundaries.
+ */
+class BatchedMobilityModel;
+
+class BatchedMobilityEngine
+{
+public:
+  BatchedMobilityEngine ();
+  uint32_t Add (Ptr<BatchedMobilityModel> model, Vector position, Rectangle bounds);
+  void Start (Time tick, Time directionInterval, double minSpeed, double maxSpeed);
+  uint32_t GetN (void) const;
+
+  double GetX (uint32_t index) const { return m_x[index]; }
+  double GetY (uint32_t index) const { return m_y[index]; }
+  Vector GetPosition (uint32_t index) const { return Vector (m_x[index], m_y[index], 0.0); }
+  Vector GetVelocity (uint32_t index) const { return Vector (m_vx[index], m_vy[index], 0.0); }
+  void SetPosition (uint32_t index, const Vector &position);
+
+private:
+  void Tick (void);
+  void Advance (double dt);
+  void ChangeDirections (void);
+
+  std::vector<double> m_x, m_y, m_vx, m_vy;
+  std::vector<double> m_minX, m_maxX, m_minY, m_maxY;
+  std::vector< Ptr<BatchedMobilityModel> > m_models;
+  Time m_tick;
+  Time m_directionInterval;
+  Time m_nextDirectionChange;
+  double m_minSpeed;
+  double m_maxSpeed;
+  Ptr<UniformRandomVariable> m_random;
+};
+
+class BatchedMobilityModel : public MobilityModel
+{
+public:
+  static TypeId GetTypeId (void);
+  BatchedMobilityModel ();
+  void Attach (BatchedMobilityEngine *engine, Rectangle bounds);
+  uint32_t GetIndex (void) const;
+  void CourseChanged (void) const;
+
+private:
+  virtual Vector DoGetPosition (void) const;
+  virtual void DoSetPosition (const Vector &position);
+  virtual Vector DoGetVelocity (void) const;
+
+  BatchedMobilityEngine *m_engine;
+  uint32_t m_index;
+  Vector m_position; // until attached to an engine
+};
+
+NS_OBJECT_ENSURE_REGISTERED (BatchedMobilityModel);
+
+TypeId
+BatchedMobilityModel::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("BatchedMobilityModel")
+    .SetParent<MobilityModel> ()
+    .SetGroupName ("Mobility")
+    .AddConstructor<BatchedMobilityModel> ()
+  ;
+  return tid;
+}
+
+BatchedMobilityModel::BatchedMobilityModel ()
+  : m_engine (0),
+    m_index (0)
+{
+}
+
+void
+BatchedMobilityModel::Attach (BatchedMobilityEngine *engine, Rectangle bounds)
+{
+  m_engine = engine;
+  m_index = engine->Add (this, m_position, bounds);
+}
+
+uint32_t
+BatchedMobilityModel::GetIndex (void) const
+{
+  return m_index;
+}
+
+void
+BatchedMobilityModel::CourseChanged (void) const
+{
+  NotifyCourseChange ();
+}
+
+Vector
+BatchedMobilityModel::DoGetPosition (void) const
+{
+  return m_engine ? m_engine->GetPosition (m_index) : m_position;
+}
+
+void
+BatchedMobilityModel::DoSetPosition (const Vector &position)
+{
+  if (m_engine)
+    {
+      m_engine->SetPosition (m_index, position);
+    }
+  else
+    {
+      m_position = position;
+    }
+  NotifyCourseChange ();
+}
+
+Vector
+BatchedMobilityModel::DoGetVelocity (void) const
+{
+  return m_engine ? m_engine->GetVelocity (m_index) : Vector ();
+}
+
+BatchedMobilityEngine::BatchedMobilityEngine ()
+  : m_minSpeed (2.0),
+    m_maxSpeed (4.0)
+{
+}
+
+uint32_t
+BatchedMobilityEngine::Add (Ptr<BatchedMobilityModel> model, Vector position, Rectangle bounds)
+{
+  m_x.push_back (position.x);
+  m_y.push_back (position.y);
+  m_vx.push_back (0.0);
+  m_vy.push_back (0.0);
+  m_minX.push_back (bounds.xMin);
+  m_maxX.push_back (bounds.xMax);
+  m_minY.push_back (bounds.yMin);
+  m_maxY.push_back (bounds.yMax);
+  m_models.push_back (model);
+  return m_x.size () - 1;
+}
+
+uint32_t
+BatchedMobilityEngine::GetN (void) const
+{
+  return m_x.size ();
+}
+
+void
+BatchedMobilityEngine::SetPosition (uint32_t index, const Vector &position)
+{
+  m_x[index] = position.x;
+  m_y[index] = position.y;
+}
+
+void
+BatchedMobilityEngine::Start (Time tick, Time directionInterval, double minSpeed, double maxSpeed)
+{
+  m_tick = tick;
+  m_directionInterval = directionInterval;
+  m_minSpeed = minSpeed;
+  m_maxSpeed = maxSpeed;
+  m_random = CreateObject<UniformRandomVariable> ();
+  m_nextDirectionChange = Simulator::Now ();
+  Simulator::ScheduleNow (&BatchedMobilityEngine::Tick, this);
+}
+
+void
+BatchedMobilityEngine::Tick (void)
+{
+  if (Simulator::Now () > Seconds (0))
+    {
+      Advance (m_tick.GetSeconds ());
+    }
+  if (Simulator::Now () >= m_nextDirectionChange)
+    {
+      ChangeDirections ();
+      m_nextDirectionChange += m_directionInterval;
+    }
+  Simulator::Schedule (m_tick, &BatchedMobilityEngine::Tick, this);
+}
+
+void
+BatchedMobilityEngine::Advance (double dt)
+{
+  const uint32_t n = m_x.size ();
+  double * __restrict__ x = m_x.data ();
+  double * __restrict__ y = m_y.data ();
+  double * __restrict__ vx = m_vx.data ();
+  double * __restrict__ vy = m_vy.data ();
+  const double * __restrict__ minX = m_minX.data ();
+  const double * __restrict__ maxX = m_maxX.data ();
+  const double * __restrict__ minY = m_minY.data ();
+  const double * __restrict__ maxY = m_maxY.data ();
+
+  for (uint32_t i = 0; i < n; i++)
+    {
+      double nx = x[i] + vx[i] * dt;
+      double ny = y[i] + vy[i] * dt;
+      // Reflect on the walls of the bounding rectangle, as the random walk does
+      double belowX = std::min (nx - minX[i], 0.0);
+      double aboveX = std::max (nx - maxX[i], 0.0);
+      double belowY = std::min (ny - minY[i], 0.0);
+      double aboveY = std::max (ny - maxY[i], 0.0);
+      x[i] = nx - 2.0 * (belowX + aboveX);
+      y[i] = ny - 2.0 * (belowY + aboveY);
+      vx[i] = (belowX + aboveX != 0.0) ? -vx[i] : vx[i];
+      vy[i] = (belowY + aboveY != 0.0) ? -vy[i] : vy[i];
+    }
+}
+
+void
+BatchedMobilityEngine::ChangeDirections (void)
+{
+  for (uint32_t i = 0; i < m_x.size (); i++)
+    {
+      double speed = m_random->GetValue (m_minSpeed, m_maxSpeed);
+      double direction = m_random->GetValue (0.0, 2 * M_PI);
+      m_vx[i] = speed * std::cos (direction);
+      m_vy[i] = speed * std::sin (direction);
+    }
+  for (const auto &model : m_models)
+    {
+      model->CourseChanged ();
+    }
+}
+
+/*
+ * Memory-mapped waypoint trace, little-endian:
+ *   char magic[8] = "NS3WPT1\n", uint32 nodeCount, uint32 reserved,
+ *   nodeCount x { uint64 offset, uint64 count }   (offset in bytes from file start)
+ *   per node, count x { double time, x, y, z }    (sorted by time)
+ * Opening only reads the index; waypoints are paged in by the kernel as the
+ * replay reaches them, and pages behind a node's replay window are released,
+ * so a multi-GB trace replays with a small resident set. mobility_trace.py
+ * converts "node,time,x,y[,z]" CSV files.
+ */
+struct TraceWaypoint
+{
+  double time;
+  double x;
+  double y;
+  double z;
+};
+
+class WaypointTrace
+{
+public:
+  WaypointTrace ();
+  ~WaypointTrace ();
+  void Open (std::string fileName);
+  uint32_t GetNodeCount (void) const;
+  const TraceWaypoint *GetWaypoints (uint32_t node, uint64_t &count) const;
+  void Release (const TraceWaypoint *from, const TraceWaypoint *to) const;
+
+private:
+  int m_fd;
+  uint8_t *m_data;
+  size_t m_size;
+  uint32_t m_nodeCount;
+  long m_pageSize;
+};
+
+WaypointTrace::WaypointTrace ()
+  : m_fd (-1),
+    m_data (0),
+    m_size (0),
+    m_nodeCount (0),
+    m_pageSize (sysconf (_SC_PAGESIZE))
+{
+}
+
+WaypointTrace::~WaypointTrace ()
+{
+  if (m_data != 0)
+    {
+      munmap (m_data, m_size);
+    }
+  if (m_fd >= 0)
+    {
+      close (m_fd);
+    }
+}
+
+void
+WaypointTrace::Open (std::string fileName)
+{
+  m_fd = open (fileName.c_str (), O_RDONLY);
+  NS_ABORT_MSG_IF (m_fd < 0, "Cannot open mobility trace " << fileName);
+  struct stat info;
+  fstat (m_fd, &info);
+  m_size = info.st_size;
+  NS_ABORT_MSG_IF (m_size < 16, "Mobility trace " << fileName << " is too short");
+
+  void *data = mmap (0, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+  NS_ABORT_MSG_IF (data == MAP_FAILED, "Cannot map mobility trace " << fileName);
+  m_data = static_cast<uint8_t *> (data);
+  madvise (m_data, m_size, MADV_SEQUENTIAL);
+
+  NS_ABORT_MSG_IF (std::memcmp (m_data, "NS3WPT1\n", 8) != 0, fileName << " is not a waypoint trace");
+  std::memcpy (&m_nodeCount, m_data + 8, sizeof (m_nodeCount));
+  NS_ABORT_MSG_IF (16 + (uint64_t) m_nodeCount * 16 > m_size, "Truncated index in " << fileName);
+
+  // Only the index is read here, the replay checks every waypoint as it reaches it
+  for (uint32_t node = 0; node < m_nodeCount; node++)
+    {
+      uint64_t count;
+      GetWaypoints (node, count);
+      NS_ABORT_MSG_IF (count == 0, "Node " << node << " has no waypoints in " << fileName);
+    }
+}
+
+uint32_t
+WaypointTrace::GetNodeCount (void) const
+{
+  return m_nodeCount;
+}
+
+const TraceWaypoint *
+WaypointTrace::GetWaypoints (uint32_t node, uint64_t &count) const
+{
+  NS_ABORT_MSG_IF (node >= m_nodeCount, "Mobility trace has no node " << node);
+  uint64_t entry[2];
+  std::memcpy (entry, m_data + 16 + (uint64_t) node * 16, sizeof (entry));
+  NS_ABORT_MSG_IF (entry[0] + entry[1] * sizeof (TraceWaypoint) > m_size, "Truncated waypoints of node " << node);
+  count = entry[1];
+  return reinterpret_cast<const TraceWaypoint *> (m_data + entry[0]);
+}
+
+// Drops the whole pages in [from, to) from memory, they are read again if touched
+void
+WaypointTrace::Release (const TraceWaypoint *from, const TraceWaypoint *to) const
+{
+  uintptr_t begin = reinterpret_cast<uintptr_t> (from);
+  uintptr_t end = reinterpret_cast<uintptr_t> (to);
+  begin = (begin + m_pageSize - 1) / m_pageSize * m_pageSize;
+  end = end / m_pageSize * m_pageSize;
+  if (end > begin)
+    {
+      madvise (reinterpret_cast<void *> (begin), end - begin, MADV_DONTNEED);
+    }
+}
+
+/*
+ * Replays one node of a WaypointTrace: linear motion between consecutive
+ * waypoints, holding the first and last positions before and after them.
+ * Only the next waypoint is scheduled, and it is checked to lie strictly
+ * after the current one before the gap is scheduled or divided by, so a bad
+ * trace aborts when the replay reaches it instead of when it is opened.
+ */
+class TraceReplayMobilityModel : public MobilityModel
+{
+public:
+  static TypeId GetTypeId (void);
+  TraceReplayMobilityModel ();
+  void Attach (const WaypointTrace *trace, uint32_t traceNode);
+
+private:
+  void Advance (void);
+  void CheckNext (void) const;
+  virtual void DoDispose (void);
+  virtual Vector DoGetPosition (void) const;
+  virtual void DoSetPosition (const Vector &position);
+  virtual Vector DoGetVelocity (void) const;
+
+  const WaypointTrace *m_trace;
+  uint32_t m_traceNode;
+  const TraceWaypoint *m_waypoints;
+  uint64_t m_count;
+  uint64_t m_cursor;
+  uint64_t m_released;
+  uint32_t m_window;
+  EventId m_next;
+  Vector m_position; // until attached to a trace
+};
+
+NS_OBJECT_ENSURE_REGISTERED (TraceReplayMobilityModel);
+
+TypeId
+TraceReplayMobilityModel::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("TraceReplayMobilityModel")
+    .SetParent<MobilityModel> ()
+    .SetGroupName ("Mobility")
+    .AddConstructor<TraceReplayMobilityModel> ()
+    .AddAttribute ("Window", "Waypoints kept behind the replay position before their pages are released",
+                   UintegerValue (1024),
+                   MakeUintegerAccessor (&TraceReplayMobilityModel::m_window),
+                   MakeUintegerChecker<uint32_t> (1))
+  ;
+  return tid;
+}
+
+TraceReplayMobilityModel::TraceReplayMobilityModel ()
+  : m_trace (0),
+    m_traceNode (0),
+    m_waypoints (0),
+    m_count (0),
+    m_cursor (0),
+    m_released (0),
+    m_window (1024)
+{
+}
+
+void
+TraceReplayMobilityModel::Attach (const WaypointTrace *trace, uint32_t traceNode)
+{
+  m_trace = trace;
+  m_traceNode = traceNode;
+  m_waypoints = trace->GetWaypoints (traceNode, m_count);
+  m_cursor = 0;
+  m_released = 0;
+  NS_ABORT_MSG_IF (m_count > 0 && !(m_waypoints[0].time >= 0),
+                   "Negative waypoint time " << m_waypoints[0].time << "s for trace node " << traceNode);
+  if (m_count > 1)
+    {
+      CheckNext ();
+      m_next = Simulator::Schedule (Seconds (m_waypoints[1].time) - Simulator::Now (),
+                                    &TraceReplayMobilityModel::Advance, this);
+    }
+  NotifyCourseChange ();
+}
+
+void
+TraceReplayMobilityModel::Advance (void)
+{
+  m_cursor ++;
+  if (m_cursor - m_released > 2 * (uint64_t) m_window)
+    {
+      m_trace->Release (m_waypoints + m_released, m_waypoints + m_cursor - m_window);
+      m_released = m_cursor - m_window;
+    }
+  if (m_cursor + 1 < m_count)
+    {
+      CheckNext ();
+      m_next = Simulator::Schedule (Seconds (m_waypoints[m_cursor + 1].time) - Simulator::Now (),
+                                    &TraceReplayMobilityModel::Advance, this);
+    }
+  NotifyCourseChange ();
+}
+
+// The gap to the next waypoint is scheduled and divided by, it must be positive
+void
+TraceReplayMobilityModel::CheckNext (void) const
+{
+  NS_ABORT_MSG_IF (!(m_waypoints[m_cursor + 1].time > m_waypoints[m_cursor].time),
+                   "Waypoint times of trace node " << m_traceNode << " are not strictly increasing at "
+                   << m_waypoints[m_cursor + 1].time << "s");
+}
+
+void
+TraceReplayMobilityModel::DoDispose (void)
+{
+  m_next.Cancel ();
+  MobilityModel::DoDispose ();
+}
+
+Vector
+TraceReplayMobilityModel::DoGetPosition (void) const
+{
+  if (m_count == 0)
+    {
+      return m_position;
+    }
+  const TraceWaypoint &from = m_waypoints[m_cursor];
+  if (m_cursor + 1 >= m_count || Simulator::Now ().GetSeconds () <= from.time)
+    {
+      return Vector (from.x, from.y, from.z);
+    }
+  const TraceWaypoint &to = m_waypoints[m_cursor + 1];
+  double alpha = (Simulator::Now ().GetSeconds () - from.time) / (to.time - from.time);
+  return Vector (from.x + alpha * (to.x - from.x),
+                 from.y + alpha * (to.y - from.y),
+                 from.z + alpha * (to.z - from.z));
+}
+
+void
+TraceReplayMobilityModel::DoSetPosition (const Vector &position)
+{
+  // The trace owns the position once attached
+  m_position = position;
+}
+
+Vector
+TraceReplayMobilityModel::DoGetVelocity (void) const
+{
+  if (m_cursor + 1 >= m_count || Simulator::Now ().GetSeconds () < m_waypoints[m_cursor].time)
+    {
+      return Vector ();
+    }
+  const TraceWaypoint &from = m_waypoints[m_cursor];
+  const TraceWaypoint &to = m_waypoints[m_cursor + 1];
+  double dt = to.time - from.time;
+  return Vector ((to.x - from.x) / dt, (to.y - from.y) / dt, (to.z - from.z) / dt);
+}
+
+// "walk" installs one RandomWalk2dMobilityModel per node, "batched" uses the engine,
+// "trace" replays mobility_trace_file (set by --mobilityTrace)
+std::string mobility_mode = "walk";
+double mobility_tick = 0.1;
+BatchedMobilityEngine batched_mobility;
+std::string mobility_trace_file = "";
+WaypointTrace mobility_trace;
+
+/*
+ * Shared medium of the wireless cluster mode. A transmission reaches the
+ * devices within Range of the sender (unit disk model). Candidates come from
+ * a uniform grid of cells one range (plus the drift margin) wide, so a send
+ * only looks at the 3x3 cells around the sender instead of every device on
+ * the channel. Cells follow mobility course changes, and a periodic sweep
+ * bounds how far a node can drift from its cell between course changes.
+ */
+class GridWirelessChannel : public SimpleChannel
+{
+public:
+  static TypeId GetTypeId (void);
+  GridWirelessChannel ();
+
+  virtual void Add (Ptr<SimpleNetDevice> device);
+  virtual void Send (Ptr<Packet> p, uint16_t protocol, Mac48Address to, Mac48Address from,
+                     Ptr<SimpleNetDevice> sender);
+  void StartRefresh (void);
+  uint64_t GetTransmissions (void) const;
+  uint64_t GetCandidates (void) const;
+
+private:
+  typedef std::pair<int64_t, int64_t> Cell;
+
+  Cell GetCell (const Vector &position) const;
+  void Update (uint32_t index);
+  void CourseChange (Ptr<const MobilityModel> mobility);
+  void Refresh (void);
+
+  double m_range;
+  double m_maxSpeed;
+  Time m_refreshInterval;
+  Time m_delay;
+  double m_cellSize;
+
+  std::vector< Ptr<SimpleNetDevice> > m_gridDevices;
+  std::vector< Ptr<MobilityModel> > m_mobility;
+  std::vector<Cell> m_deviceCell;
+  std::map<const MobilityModel *, uint32_t> m_mobilityIndex;
+  std::map<Cell, std::vector<uint32_t> > m_cells;
+
+  uint64_t m_transmissions;
+  uint64_t m_candidates;
+};
+
+NS_OBJECT_ENSURE_REGISTERED (GridWirelessChannel);
+
+TypeId
+GridWirelessChannel::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("GridWirelessChannel")
+    .SetParent<SimpleChannel> ()
+    .SetGroupName ("Network")
+    .AddConstructor<GridWirelessChannel> ()
+    .AddAttribute ("Range", "Interference range in meters",
+                   DoubleValue (60.0),
+                   MakeDoubleAccessor (&GridWirelessChannel::m_range),
+                   MakeDoubleChecker<double> (0.0))
+    .AddAttribute ("MaxSpeed", "Highest node speed (m/s), sizes the drift margin of the cells",
+                   DoubleValue (4.0),
+                   MakeDoubleAccessor (&GridWirelessChannel::m_maxSpeed),
+                   MakeDoubleChecker<double> (0.0))
+    .AddAttribute ("RefreshInterval", "Time between sweeps that re-file every node in its cell",
+                   TimeValue (Seconds (1.0)),
+                   MakeTimeAccessor (&GridWirelessChannel::m_refreshInterval),
+                   MakeTimeChecker ())
+    .AddAttribute ("PropagationDelay", "Fixed delay added to the speed of light delay",
+                   TimeValue (MicroSeconds (1)),
+                   MakeTimeAccessor (&GridWirelessChannel::m_delay),
+                   MakeTimeChecker ())
+  ;
+  return tid;
+}
+
+GridWirelessChannel::GridWirelessChannel ()
+  : m_range (60.0),
+    m_maxSpeed (4.0),
+    m_cellSize (0.0),
+    m_transmissions (0),
+    m_candidates (0)
+{
+}
+
+GridWirelessChannel::Cell
+GridWirelessChannel::GetCell (const Vector &position) const
+{
+  return Cell ((int64_t) std::floor (position.x / m_cellSize), (int64_t) std::floor (position.y / m_cellSize));
+}
+
+void
+GridWirelessChannel::Add (Ptr<SimpleNetDevice> device)
+{
+  SimpleChannel::Add (device);
+  m_cellSize = m_range + m_maxSpeed * m_refreshInterval.GetSeconds ();
+
+  Ptr<MobilityModel> mobility = device->GetNode ()->GetObject<MobilityModel> ();
+  NS_ABORT_MSG_IF (mobility == 0, "Wireless devices need a mobility model before joining the channel");
+  uint32_t index = m_gridDevices.size ();
+  m_gridDevices.push_back (device);
+  m_mobility.push_back (mobility);
+  m_mobilityIndex[PeekPointer (mobility)] = index;
+  m_deviceCell.push_back (GetCell (mobility->GetPosition ()));
+  m_cells[m_deviceCell[index]].push_back (index);
+  mobility->TraceConnectWithoutContext ("CourseChange", MakeCallback (&GridWirelessChannel::CourseChange, this));
+}
+
+void
+GridWirelessChannel::Update (uint32_t index)
+{
+  Cell cell = GetCell (m_mobility[index]->GetPosition ());
+  if (cell == m_deviceCell[index]) return;
+
+  std::vector<uint32_t> &old = m_cells[m_deviceCell[index]];
+  old.erase (std::find (old.begin (), old.end (), index));
+  m_cells[cell].push_back (index);
+  m_deviceCell[index] = cell;
+}
+
+void
+GridWirelessChannel::CourseChange (Ptr<const MobilityModel> mobility)
+{
+  std::map<const MobilityModel *, uint32_t>::const_iterator it = m_mobilityIndex.find (PeekPointer (mobility));
+  if (it != m_mobilityIndex.end ())
+    {
+      Update (it->second);
+    }
+}
+
+void
+GridWirelessChannel::StartRefresh (void)
+{
+  Simulator::Schedule (m_refreshInterval, &GridWirelessChannel::Refresh, this);
+}
+
+void
+GridWirelessChannel::Refresh (void)
+{
+  for (uint32_t index = 0; index < m_gridDevices.size (); index++)
+    {
+      Update (index);
+    }
+  Simulator::Schedule (m_refreshInterval, &GridWirelessChannel::Refresh, this);
+}
+
+void
+GridWirelessChannel::Send (Ptr<Packet> p, uint16_t protocol, Mac48Address to, Mac48Address from,
+                           Ptr<SimpleNetDevice> sender)
+{
+  m_transmissions ++;
+  Vector origin = sender->GetNode ()->GetObject<MobilityModel> ()->GetPosition ();
+  Cell centre = GetCell (origin);
+  for (int64_t dx = -1; dx <= 1; dx++)
+    {
+      for (int64_t dy = -1; dy <= 1; dy++)
+        {
+          std::map<Cell, std::vector<uint32_t> >::const_iterator cell = m_cells.find (Cell (centre.first + dx, centre.second + dy));
+          if (cell == m_cells.end ()) continue;
+          for (uint32_t index : cell->second)
+            {
+              Ptr<SimpleNetDevice> receiver = m_gridDevices[index];
+              if (receiver == sender) continue;
+              m_candidates ++;
+              double distance = CalculateDistance (origin, m_mobility[index]->GetPosition ());
+              if (distance > m_range) continue;
+              Time delay = m_delay + Seconds (distance / 299792458.0);
+              Simulator::ScheduleWithContext (receiver->GetNode ()->GetId (), delay,
+                                              &SimpleNetDevice::Receive, receiver, p->Copy (), protocol, to, from);
+            }
+        }
+    }
+}
+
+uint64_t
+GridWirelessChannel::GetTransmissions (void) const
+{
+  return m_transmissions;
+}
+
+uint64_t
+GridWirelessChannel::GetCandidates (void) const
+{
+  return m_candidates;
+}
+
+// "p2p" wires clusters with point to point links, "wireless" puts every node on one ad hoc channel
+std::string link_mode = "p2p";
+double wireless_range = 60.0;
+Ptr<GridWirelessChannel> wireless_channel;
+
+/*
+ * Point to point device that coalesces IPv4 packets into larger frames.
+ * Send buffers outgoing packets until MaxFrameSize bytes are waiting or the
+ * first of them has waited MaxDelay, then sends them as one frame of
+ * subframes, each a marker byte and a 16 bit length before the packet. The
+ * marker can never start an IPv4 header (0x45), so the receiving device tells
+ * frames from plain packets by their first byte and hands every subframe to
+ * the stack on its own. The upper receive callback is wrapped in
+ * SetReceiveCallback, the point to point machinery itself is untouched.
+ * Send has already returned true for held packets, so a frame the device
+ * queue refuses on flush loses all of them; they are counted as dropped.
+ */
+class AggregatingNetDevice : public PointToPointNetDevice
+{
+public:
+  static const uint8_t subframeMarker = 0xA5;
+  static const uint32_t subframeHeader = 3;
+
+  static TypeId GetTypeId (void);
+  AggregatingNetDevice ();
+
+  virtual bool Send (Ptr<Packet> packet, const Address &dest, uint16_t protocolNumber);
+  virtual void SetReceiveCallback (NetDevice::ReceiveCallback cb);
+
+  uint64_t GetPacketsAggregated (void) const;
+  uint64_t GetFramesSent (void) const;
+  uint64_t GetPacketsHeld (void) const;  // aggregated or sent alone after waiting
+  uint64_t GetPacketsDropped (void) const;  // held packets whose frame the device queue refused
+  double GetDelaySum (void) const;   // seconds packets spent waiting for their frame
+  double GetDelayMax (void) const;
+
+protected:
+  virtual void DoDispose (void);
+
+private:
+  void Flush (void);
+  bool Deaggregate (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &from);
+
+  uint32_t m_maxFrameSize;
+  Time m_maxDelay;
+  NetDevice::ReceiveCallback m_upper;
+  std::vector< Ptr<Packet> > m_pending;
+  std::vector<Time> m_pendingSince;
+  uint32_t m_pendingBytes;
+  Address m_pendingDest;
+  EventId m_flushEvent;
+  uint64_t m_packetsAggregated;
+  uint64_t m_framesSent;
+  uint64_t m_packetsHeld;
+  uint64_t m_packetsDropped;
+  double m_delaySum;
+  double m_delayMax;
+};
+
+NS_OBJECT_ENSURE_REGISTERED (AggregatingNetDevice);
+
+TypeId
+AggregatingNetDevice::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("AggregatingNetDevice")
+    .SetParent<PointToPointNetDevice> ()
+    .SetGroupName ("PointToPoint")
+    .AddConstructor<AggregatingNetDevice> ()
+    .AddAttribute ("MaxFrameSize", "Bytes of subframes after which a frame is sent",
+                   UintegerValue (1500),
+                   MakeUintegerAccessor (&AggregatingNetDevice::m_maxFrameSize),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("MaxDelay", "Longest a packet waits for its frame to fill",
+                   TimeValue (MilliSeconds (1)),
+                   MakeTimeAccessor (&AggregatingNetDevice::m_maxDelay),
+                   MakeTimeChecker ())
+  ;
+  return tid;
+}
+
+AggregatingNetDevice::AggregatingNetDevice ()
+  : m_maxFrameSize (1500),
+    m_pendingBytes (0),
+    m_packetsAggregated (0),
+    m_framesSent (0),
+    m_packetsHeld (0),
+    m_packetsDropped (0),
+    m_delaySum (0.0),
+    m_delayMax (0.0)
+{
+}
+
+void
+AggregatingNetDevice::DoDispose (void)
+{
+  Simulator::Cancel (m_flushEvent);
+  m_pending.clear ();
+  m_upper = MakeNullCallback<bool, Ptr<NetDevice>, Ptr<const Packet>, uint16_t, const Address &> ();
+  PointToPointNetDevice::DoDispose ();
+}
+
+bool
+AggregatingNetDevice::Send (Ptr<Packet> packet, const Address &dest, uint16_t protocolNumber)
+{
+  if (protocolNumber != 0x0800 || packet->GetSize () + subframeHeader > m_maxFrameSize)
+    {
+      return PointToPointNetDevice::Send (packet, dest, protocolNumber);
+    }
+  if (m_pendingBytes + packet->GetSize () + subframeHeader > m_maxFrameSize)
+    {
+      Flush ();
+    }
+  if (m_pending.empty ())
+    {
+      m_pendingDest = dest;
+      m_flushEvent = Simulator::Schedule (m_maxDelay, &AggregatingNetDevice::Flush, this);
+    }
+  m_pending.push_back (packet);
+  m_pendingSince.push_back (Simulator::Now ());
+  m_pendingBytes += packet->GetSize () + subframeHeader;
+  return true;
+}
+
+void
+AggregatingNetDevice::Flush (void)
+{
+  Simulator::Cancel (m_flushEvent);
+  if (m_pending.empty ()) return;
+  for (const Time &since : m_pendingSince)
+    {
+      double waited = (Simulator::Now () - since).GetSeconds ();
+      m_delaySum += waited;
+      m_delayMax = std::max (m_delayMax, waited);
+    }
+  m_packetsHeld += m_pending.size ();
+  bool sent;
+  if (m_pending.size () == 1)
+    {
+      sent = PointToPointNetDevice::Send (m_pending[0], m_pendingDest, 0x0800);
+    }
+  else
+    {
+      Ptr<Packet> frame = Create<Packet> ();
+      for (const auto &packet : m_pending)
+        {
+          uint8_t header[subframeHeader] = {subframeMarker, (uint8_t) (packet->GetSize () >> 8), (uint8_t) (packet->GetSize () & 0xff)};
+          frame->AddAtEnd (Create<Packet> (header, subframeHeader));
+          frame->AddAtEnd (packet);
+        }
+      m_packetsAggregated += m_pending.size ();
+      m_framesSent ++;
+      sent = PointToPointNetDevice::Send (frame, m_pendingDest, 0x0800);
+    }
+  if (!sent)
+    {
+      m_packetsDropped += m_pending.size ();
+    }
+  m_pending.clear ();
+  m_pendingSince.clear ();
+  m_pendingBytes = 0;
+}
+
+void
+AggregatingNetDevice::SetReceiveCallback (NetDevice::ReceiveCallback cb)
+{
+  m_upper = cb;
+  PointToPointNetDevice::SetReceiveCallback (MakeCallback (&AggregatingNetDevice::Deaggregate, this));
+}
+
+bool
+AggregatingNetDevice::Deaggregate (Ptr<NetDevice> device, Ptr<const Packet> packet, uint16_t protocol, const Address &from)
+{
+  uint8_t header[subframeHeader];
+  if (packet->CopyData (header, 1) < 1 || header[0] != subframeMarker)
+    {
+      return m_upper (device, packet, protocol, from);
+    }
+  Ptr<Packet> frame = packet->Copy ();
+  while (frame->GetSize () >= subframeHeader)
+    {
+      frame->CopyData (header, subframeHeader);
+      uint32_t length = (header[1] << 8) | header[2];
+      frame->RemoveAtStart (subframeHeader);
+      m_upper (device, frame->CreateFragment (0, length), protocol, from);
+      frame->RemoveAtStart (length);
+    }
+  return true;
+}
+
+uint64_t
+AggregatingNetDevice::GetPacketsAggregated (void) const
+{
+  return m_packetsAggregated;
+}
+
+uint64_t
+AggregatingNetDevice::GetFramesSent (void) const
+{
+  return m_framesSent;
+}
+
+uint64_t
+AggregatingNetDevice::GetPacketsHeld (void) const
+{
+  return m_packetsHeld;
+}
+
+uint64_t
+AggregatingNetDevice::GetPacketsDropped (void) const
+{
+  return m_packetsDropped;
+}
+
+double
+AggregatingNetDevice::GetDelaySum (void) const
+{
+  return m_delaySum;
+}
+
+double
+AggregatingNetDevice::GetDelayMax (void) const
+{
+  return m_delayMax;
+}
+
+bool head_aggregation = false;
+uint32_t aggregation_size = 1500;
+double aggregation_delay = 0.001;   // seconds
+
+/*
+ * Bucketed timing wheel scheduler for many near future events. The wheel has
+ * Buckets slots of BucketWidth each, covering the Buckets*BucketWidth after
+ * the current slot; events in it are appended unsorted to their slot. Only
+ * the current slot is kept sorted (descending, so the next event is popped
+ * from the back), and a slot is sorted once when the cursor reaches it.
+ * Events beyond the wheel wait in an overflow heap and move onto the wheel
+ * as the cursor advances; when the wheel runs dry the cursor jumps straight
+ * to the earliest overflow event. The 2 ms link delays, step timers and
+ * walk ticks of the scenarios land a few slots ahead, so inserts are O(1)
+ * and the sort cost is shared by the events of one slot.
+ */
+class TimingWheelScheduler : public Scheduler
+{
+public:
+  static TypeId GetTypeId (void);
+  TimingWheelScheduler ();
+  virtual ~TimingWheelScheduler ();
+
+  virtual void Insert (const Scheduler::Event &ev);
+  virtual bool IsEmpty (void) const;
+  virtual Scheduler::Event PeekNext (void) const;
+  virtual Scheduler::Event RemoveNext (void);
+  virtual void Remove (const Scheduler::Event &ev);
+
+private:
+  struct Later
+  {
+    bool operator() (const Scheduler::Event &a, const Scheduler::Event &b) const
+    {
+      return b.key < a.key;
+    }
+  };
+  uint64_t Width (void) const;
+  void Place (const Scheduler::Event &ev);
+  void PullOverflow (void);
+  void Advance (void);
+
+  Time m_bucketWidth;
+  uint32_t m_nBuckets;
+  std::vector< std::vector<Scheduler::Event> > m_buckets;
+  std::vector<Scheduler::Event> m_current;     // sorted, earliest last
+  std::vector<Scheduler::Event> m_overflow;    // heap, earliest first
+  uint64_t m_cursorStart;                      // start of the current slot, in time steps
+  uint64_t m_inWheel;
+};
+
+NS_OBJECT_ENSURE_REGISTERED (TimingWheelScheduler);
+
+TypeId
+TimingWheelScheduler::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("TimingWheelScheduler")
+    .SetParent<Scheduler> ()
+    .SetGroupName ("Core")
+    .AddConstructor<TimingWheelScheduler> ()
+    .AddAttribute ("BucketWidth", "Time covered by one slot of the wheel",
+                   TimeValue (MicroSeconds (500)),
+                   MakeTimeAccessor (&TimingWheelScheduler::m_bucketWidth),
+                   MakeTimeChecker (TimeStep (1)))
+    .AddAttribute ("Buckets", "Slots of the wheel",
+                   UintegerValue (4096),
+                   MakeUintegerAccessor (&TimingWheelScheduler::m_nBuckets),
+                   MakeUintegerChecker<uint32_t> (2))
+  ;
+  return tid;
+}
+
+TimingWheelScheduler::TimingWheelScheduler ()
+  : m_nBuckets (4096),
+    m_cursorStart (0),
+    m_inWheel (0)
+{
+}
+
+TimingWheelScheduler::~TimingWheelScheduler ()
+{
+}
+
+uint64_t
+TimingWheelScheduler::Width (void) const
+{
+  return std::max<int64_t> (1, m_bucketWidth.GetTimeStep ());
+}
+
+// Current slot, wheel or overflow, by distance from the cursor
+void
+TimingWheelScheduler::Place (const Scheduler::Event &ev)
+{
+  uint64_t width = Width ();
+  if (m_buckets.empty ())
+    {
+      m_buckets.resize (m_nBuckets);
+    }
+  if (ev.key.m_ts < m_cursorStart + width)
+    {
+      std::vector<Scheduler::Event>::iterator at = std::lower_bound (m_current.begin (), m_current.end (), ev, Later ());
+      m_current.insert (at, ev);
+    }
+  else if (ev.key.m_ts < m_cursorStart + width * m_nBuckets)
+    {
+      m_buckets[(ev.key.m_ts / width) % m_nBuckets].push_back (ev);
+      m_inWheel ++;
+    }
+  else
+    {
+      m_overflow.push_back (ev);
+      std::push_heap (m_overflow.begin (), m_overflow.end (), Later ());
+    }
+}
+
+void
+TimingWheelScheduler::PullOverflow (void)
+{
+  uint64_t horizon = m_cursorStart + Width () * m_nBuckets;
+  while (!m_overflow.empty () && m_overflow.front ().key.m_ts < horizon)
+    {
+      std::pop_heap (m_overflow.begin (), m_overflow.end (), Later ());
+      Scheduler::Event ev = m_overflow.back ();
+      m_overflow.pop_back ();
+      Place (ev);
+    }
+}
+
+// Moves the cursor until the current slot holds an event
+void
+TimingWheelScheduler::Advance (void)
+{
+  uint64_t width = Width ();
+  while (m_current.empty () && (m_inWheel > 0 || !m_overflow.empty ()))
+    {
+      if (m_inWheel == 0)
+        {
+          uint64_t earliest = m_overflow.front ().key.m_ts;
+          m_cursorStart = earliest - earliest % width;
+        }
+      else
+        {
+          m_cursorStart += width;
+        }
+      std::vector<Scheduler::Event> &bucket = m_buckets[(m_cursorStart / width) % m_nBuckets];
+      m_inWheel -= bucket.size ();
+      m_current.swap (bucket);
+      bucket.clear ();
+      std::sort (m_current.begin (), m_current.end (), Later ());
+      PullOverflow ();
+    }
+}
+
+void
+TimingWheelScheduler::Insert (const Scheduler::Event &ev)
+{
+  Place (ev);
+}
+
+bool
+TimingWheelScheduler::IsEmpty (void) const
+{
+  return m_current.empty () && m_inWheel == 0 && m_overflow.empty ();
+}
+
+Scheduler::Event
+TimingWheelScheduler::PeekNext (void) const
+{
+  // Advancing the cursor changes no event order, only where events are kept
+  const_cast<TimingWheelScheduler *> (this)->Advance ();
+  NS_ASSERT (!m_current.empty ());
+  return m_current.back ();
+}
+
+Scheduler::Event
+TimingWheelScheduler::RemoveNext (void)
+{
+  Advance ();
+  NS_ASSERT (!m_current.empty ());
+  Scheduler::Event ev = m_current.back ();
+  m_current.pop_back ();
+  return ev;
+}
+
+void
+TimingWheelScheduler::Remove (const Scheduler::Event &ev)
+{
+  for (std::vector<Scheduler::Event>::iterator i = m_current.begin (); i != m_current.end (); i++)
+    {
+      if (i->key.m_uid == ev.key.m_uid)
+        {
+          m_current.erase (i);
+          return;
+        }
+    }
+  if (!m_buckets.empty ())
+    {
+      std::vector<Scheduler::Event> &bucket = m_buckets[(ev.key.m_ts / Width ()) % m_nBuckets];
+      for (std::vector<Scheduler::Event>::iterator i = bucket.begin (); i != bucket.end (); i++)
+        {
+          if (i->key.m_uid == ev.key.m_uid)
+            {
+              bucket.erase (i);
+              m_inWheel --;
+              return;
+            }
+        }
+    }
+  for (std::vector<Scheduler::Event>::iterator i = m_overflow.begin (); i != m_overflow.end (); i++)
+    {
+      if (i->key.m_uid == ev.key.m_uid)
+        {
+          m_overflow.erase (i);
+          std::make_heap (m_overflow.begin (), m_overflow.end (), Later ());
+          return;
+        }
+    }
+  NS_FATAL_ERROR ("TimingWheelScheduler has no event " << ev.key.m_uid);
+}
+
+// map, list, heap, calendar and priority are the ns-3 schedulers, wheel the one above
+std::string scheduler_type = "map";
+
+void SelectScheduler(void)
+{
+  ObjectFactory factory;
+  if (scheduler_type == "map") factory.SetTypeId ("ns3::MapScheduler");
+  else if (scheduler_type == "list") factory.SetTypeId ("ns3::ListScheduler");
+  else if (scheduler_type == "heap") factory.SetTypeId ("ns3::HeapScheduler");
+  else if (scheduler_type == "calendar") factory.SetTypeId ("ns3::CalendarScheduler");
+  else if (scheduler_type == "priority") factory.SetTypeId ("ns3::PriorityQueueScheduler");
+  else if (scheduler_type == "wheel") factory.SetTypeId ("TimingWheelScheduler");
+  else NS_FATAL_ERROR ("Unknown scheduler " << scheduler_type);
+  Simulator::SetScheduler (factory);
+}
+
+/*
+ * Live metrics. Counters, gauges and histograms are registered before the
+ * run and the simulation thread then only does relaxed atomic stores on
+ * them; it is their only writer, so adds are a load and a store rather than
+ * a read-modify-write. A background thread serves a snapshot in the
+ * Prometheus text format to whoever connects: one snapshot per connection
+ * on the Unix socket, a GET answered over HTTP on 127.0.0.1. A snapshot is
+ * not synchronized with the event loop, values can be an event apart from
+ * each other, but it never holds the simulation up.
+ */
+class Metric
+{
+public:
+  enum Kind { COUNTER, GAUGE, HISTOGRAM };
+
+  Metric (std::string name, std::string help, Kind kind, std::vector<double> bounds);
+  void Add (double amount);
+  void Set (double value);
+  void Observe (double value);
+  void Render (std::ostream &out) const;
+
+private:
+  std::string m_name;
+  std::string m_help;
+  Kind m_kind;
+  std::atomic<double> m_value;                    // counter total, gauge value or histogram sum
+  std::atomic<uint64_t> m_count;                  // histogram observations
+  std::vector<double> m_bounds;                   // histogram upper bounds, ascending
+  std::vector< std::atomic<uint64_t> > m_buckets; // per bound plus +Inf, not cumulative
+};
+
+Metric::Metric (std::string name, std::string help, Kind kind, std::vector<double> bounds)
+  : m_name (name),
+    m_help (help),
+    m_kind (kind),
+    m_value (0.0),
+    m_count (0),
+    m_bounds (bounds),
+    m_buckets (bounds.size () + 1)
+{
+}
+
+void
+Metric::Add (double amount)
+{
+  m_value.store (m_value.load (std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+void
+Metric::Set (double value)
+{
+  m_value.store (value, std::memory_order_relaxed);
+}
+
+void
+Metric::Observe (double value)
+{
+  uint32_t bucket = std::lower_bound (m_bounds.begin (), m_bounds.end (), value) - m_bounds.begin ();
+  m_buckets[bucket].store (m_buckets[bucket].load (std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  m_count.store (m_count.load (std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  Add (value);
+}
+
+void
+Metric::Render (std::ostream &out) const
+{
+  static const char *kinds[] = {"counter", "gauge", "histogram"};
+  out << "# HELP " << m_name << " " << m_help << "\n";
+  out << "# TYPE " << m_name << " " << kinds[m_kind] << "\n";
+  if (m_kind != HISTOGRAM)
+    {
+      out << m_name << " " << m_value.load (std::memory_order_relaxed) << "\n";
+      return;
+    }
+  uint64_t cumulative = 0;
+  for (uint32_t i = 0; i < m_buckets.size (); i++)
+    {
+      cumulative += m_buckets[i].load (std::memory_order_relaxed);
+      out << m_name << "_bucket{le=\"";
+      if (i < m_bounds.size ()) out << m_bounds[i];
+      else out << "+Inf";
+      out << "\"} " << cumulative << "\n";
+    }
+  out << m_name << "_sum " << m_value.load (std::memory_order_relaxed) << "\n";
+  out << m_name << "_count " << cumulative << "\n";
+}
+
+class MetricsRegistry
+{
+public:
+  MetricsRegistry ();
+  Metric *AddCounter (std::string name, std::string help);
+  Metric *AddGauge (std::string name, std::string help);
+  Metric *AddHistogram (std::string name, std::string help, std::vector<double> bounds);
+  std::string Snapshot (void) const;
+  void Serve (std::string socketPath, uint16_t port);
+  void Shutdown (void);
+  bool IsServing (void) const;
+
+private:
+  Metric *Register (std::string name, std::string help, Metric::Kind kind, std::vector<double> bounds);
+  void ServeLoop (void);
+  void Answer (int connection, bool http) const;
+
+  std::list<Metric> m_metrics;   // a list, metrics are neither copied nor moved once handed out
+  mutable std::mutex m_lock;     // registration against snapshots, never taken by the event loop
+  std::thread m_thread;
+  std::atomic<bool> m_stop;
+  int m_unixListener;
+  int m_httpListener;
+  std::string m_socketPath;
+};
+
+MetricsRegistry::MetricsRegistry ()
+  : m_stop (false),
+    m_unixListener (-1),
+    m_httpListener (-1)
+{
+}
+
+Metric *
+MetricsRegistry::Register (std::string name, std::string help, Metric::Kind kind, std::vector<double> bounds)
+{
+  std::lock_guard<std::mutex> guard (m_lock);
+  m_metrics.emplace_back (name, help, kind, bounds);
+  return &m_metrics.back ();
+}
+
+Metric *
+MetricsRegistry::AddCounter (std::string name, std::string help)
+{
+  return Register (name, help, Metric::COUNTER, std::vector<double> ());
+}
+
+Metric *
+MetricsRegistry::AddGauge (std::string name, std::string help)
+{
+  return Register (name, help, Metric::GAUGE, std::vector<double> ());
+}
+
+Metric *
+MetricsRegistry::AddHistogram (std::string name, std::string help, std::vector<double> bounds)
+{
+  std::sort (bounds.begin (), bounds.end ());
+  return Register (name, help, Metric::HISTOGRAM, bounds);
+}
+
+std::string
+MetricsRegistry::Snapshot (void) const
+{
+  std::lock_guard<std::mutex> guard (m_lock);
+  std::ostringstream out;
+  for (const auto &metric : m_metrics)
+    {
+      metric.Render (out);
+    }
+  return out.str ();
+}
+
+bool
+MetricsRegistry::IsServing (void) const
+{
+  return m_thread.joinable ();
+}
+
+void
+MetricsRegistry::Serve (std::string socketPath, uint16_t port)
+{
+  if (socketPath != "")
+    {
+      sockaddr_un address;
+      std::memset (&address, 0, sizeof (address));
+      address.sun_family = AF_UNIX;
+      NS_ABORT_MSG_IF (socketPath.size () >= sizeof (address.sun_path), "Metrics socket path too long: " << socketPath);
+      std::strncpy (address.sun_path, socketPath.c_str (), sizeof (address.sun_path) - 1);
+      ::unlink (socketPath.c_str ());
+      m_unixListener = ::socket (AF_UNIX, SOCK_STREAM, 0);
+      NS_ABORT_MSG_IF (m_unixListener < 0 || ::bind (m_unixListener, (sockaddr *) &address, sizeof (address)) != 0
+                       || ::listen (m_unixListener, 8) != 0, "Cannot listen on metrics socket " << socketPath);
+      m_socketPath = socketPath;
+    }
+  if (port != 0)
+    {
+      sockaddr_in address;
+      std::memset (&address, 0, sizeof (address));
+      address.sin_family = AF_INET;
+      address.sin_port = htons (port);
+      address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+      int reuse = 1;
+      m_httpListener = ::socket (AF_INET, SOCK_STREAM, 0);
+      NS_ABORT_MSG_IF (m_httpListener < 0, "Cannot open metrics port " << port);
+      ::setsockopt (m_httpListener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof (reuse));
+      NS_ABORT_MSG_IF (::bind (m_httpListener, (sockaddr *) &address, sizeof (address)) != 0
+                       || ::listen (m_httpListener, 8) != 0, "Cannot listen on metrics port " << port);
+    }
+  if (m_unixListener < 0 && m_httpListener < 0) return;
+  m_stop = false;
+  m_thread = std::thread (&MetricsRegistry::ServeLoop, this);
+}
+
+// Background thread: polls the listeners so Shutdown is noticed within 200ms
+void
+MetricsRegistry::ServeLoop (void)
+{
+  while (!m_stop.load ())
+    {
+      pollfd listeners[2] = {{m_unixListener, POLLIN, 0}, {m_httpListener, POLLIN, 0}};
+      if (::poll (listeners, 2, 200) <= 0) continue;
+      for (uint32_t i = 0; i < 2; i++)
+        {
+          if (listeners[i].fd < 0 || !(listeners[i].revents & POLLIN)) continue;
+          int connection = ::accept (listeners[i].fd, 0, 0);
+          if (connection < 0) continue;
+          Answer (connection, i == 1);
+          ::close (connection);
+        }
+    }
+}
+
+void
+MetricsRegistry::Answer (int connection, bool http) const
+{
+  std::string body = Snapshot ();
+  std::string reply = body;
+  if (http)
+    {
+      // The request itself is not parsed, every path gets the metrics
+      pollfd request = {connection, POLLIN, 0};
+      char discard[1024];
+      if (::poll (&request, 1, 1000) > 0)
+        {
+          ssize_t ignored = ::recv (connection, discard, sizeof (discard), 0);
+          (void) ignored;
+        }
+      std::ostringstream header;
+      header << "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+             << body.size () << "\r\nConnection: close\r\n\r\n";
+      reply = header.str () + body;
+    }
+  size_t sent = 0;
+  while (sent < reply.size ())
+    {
+      ssize_t n = ::send (connection, reply.data () + sent, reply.size () - sent, MSG_NOSIGNAL);
+      if (n <= 0) break;
+      sent += n;
+    }
+}
+
+void
+MetricsRegistry::Shutdown (void)
+{
+  m_stop = true;
+  if (m_thread.joinable ())
+    {
+      m_thread.join ();
+    }
+  if (m_unixListener >= 0)
+    {
+      ::close (m_unixListener);
+      ::unlink (m_socketPath.c_str ());
+      m_unixListener = -1;
+    }
+  if (m_httpListener >= 0)
+    {
+      ::close (m_httpListener);
+      m_httpListener = -1;
+    }
+}
+
+std::string metrics_socket = "";    // Unix socket path, empty for none
+uint32_t metrics_port = 0;          // HTTP port on 127.0.0.1, 0 for none
+double metrics_interval = 0.5;      // simulated seconds between gauge samples
+MetricsRegistry live_metrics;
+Metric *metric_packets = 0;
+Metric *metric_bytes = 0;
+Metric *metric_latency = 0;
+
+// Echo replies and flow sink packets alike
+void OnMetricsSample(double latency, uint32_t bytes)
+{
+  if (metric_packets)
+    {
+      metric_packets->Add (1);
+      metric_bytes->Add (bytes);
+      metric_latency->Observe (latency);
+    }
+}
+
+bool cluster_multicast = false;
+std::string multicast_rate = "64kbps";
+uint32_t heads_per_cluster = 1;
+std::string head_balance = "ecmp";   // ecmp or weighted
+std::string head_weights = "";       // comma separated weight per head for weighted
+std::string route_cache_dir = "";    // global route cache, see RouteRecord
+bool lpm_routing = false;            // trie lookups in front of global routing, see LpmGlobalRouting
+bool lpm_benchmark = false;
+
+class RoutingExperiment
+{
+public:
+  RoutingExperiment ();
+  void Run (int nSinks, double txp, std::string CSVfileName);
+  std::string CommandSetup (int argc, char **argv);
+  
+private:
+  Ptr<Socket> SetupPacketSend(Ipv4Address addr, Ptr<Node> node, uint32_t checkPort);
+  void SendPacket (Ptr<Socket> socket, uint32_t bytes);
+  void CheckThroughput ();
+  void CreateClusters (void);
+  void SetupPointToPointLinks (void);
+  void SetupMobility (void);
+  void AssignPointToPointAddresses (void);
+  void SetupWirelessLinks (void);
+  void SetupApplications (void);
+  void ConfigureRouting (InternetStackHelper &stack);
+  void InstallDsr (void);
+  void WriteRoutingReport (void);
+  void SetupTrafficGenerators (void);
+  void ReportTrafficGenerators (void);
+  
+
+  uint32_t port;
+  uint32_t bytesTotal;
+  uint32_t packetsReceived;
+
+  std::string m_CSVfileName;
+  int m_nSinks;
+  std::string m_protocolName;
+  double m_txp;
+  bool m_traceMobility;
+  uint32_t m_protocol;
+  std::string m_reportFileName;
+};
+
+Ptr<OpenGymSpace> MyGetObservationSpace(void)
+{
+  uint32_t nodeNum = nodesPerCluster;
+  float low = 0.0;
+  float high = 100.0;
+  std::vector<uint32_t> shape = {nodeNum,};
+  std::string dtype = TypeNameGet<uint32_t> ();
+  Ptr<OpenGymBoxSpace> space = CreateObject<OpenGymBoxSpace> (low, high, shape, dtype);
+  NS_LOG_UNCOND ("MyGetObservationSpace: " << space);
+  return space;
+}
+
+Ptr<OpenGymSpace> MyGetActionSpace(void)
+{
+  uint32_t headLinks = clusterConnectionDevices.size();
+  Ptr<OpenGymSpace> space;
+  if (action_mode == "rate")
+    {
+      std::vector<uint32_t> shape = {headLinks,};
+      std::string dtype = TypeNameGet<float> ();
+      space = CreateObject<OpenGymBoxSpace> (min_link_rate, max_link_rate, shape, dtype);
+    }
+  else if (action_mode == "path")
+    {
+      std::vector<uint32_t> shape = {headLinks,};
+      std::string dtype = TypeNameGet<uint32_t> ();
+      space = CreateObject<OpenGymBoxSpace> (1, max_path_metric, shape, dtype);
+    }
+  else
+    {
+      // One server choice per client cluster (every cluster but cluster 0)
+      std::vector<uint32_t> shape = {(uint32_t)maxClusters - 1,};
+      std::string dtype = TypeNameGet<uint32_t> ();
+      space = CreateObject<OpenGymBoxSpace> (0, nodesPerCluster - 1, shape, dtype);
+    }
+  NS_LOG_UNCOND ("MyGetActionSpace: " << space);
+  return space;
+}
+
+
+/*
+ * Trajectory recorder for offline RL datasets. Each gym step becomes one
+ * little-endian binary record:
+ *   uint32 step, double time, uint8 done, float reward,
+ *   uint32 nObs, float obs[nObs], uint32 nAction, float action[nAction]
+ * after an 8 byte "NS3TRJ1\n" file header. The last step of an episode has
+ * no action (nAction = 0). With compression the stream is piped through gzip.
+ */
+class TrajectoryRecorder
+{
+public:
+  TrajectoryRecorder ();
+  void Open (std::string fileName, bool compress);
+  void Close (void);
+  bool IsOpen (void) const;
+
+  void RecordObservation (Ptr<OpenGymDataContainer> observation);
+  void RecordReward (float reward);
+  void RecordGameOver (bool done);
+  void RecordAction (Ptr<OpenGymDataContainer> action);
+
+private:
+  static std::vector<float> GetValues (Ptr<OpenGymDataContainer> container);
+  void Flush (void);
+  void WriteValues (const std::vector<float> &values);
+
+  FILE *m_file;
+  bool m_piped;
+  bool m_pending;
+  uint32_t m_step;
+  double m_time;
+  bool m_done;
+  float m_reward;
+  std::vector<float> m_observation;
+  std::vector<float> m_action;
+};
+
+TrajectoryRecorder::TrajectoryRecorder ()
+  : m_file (0),
+    m_piped (false),
+    m_pending (false),
+    m_step (0),
+    m_time (0.0),
+    m_done (false),
+    m_reward (0.0)
+{
+}
+
+void
+TrajectoryRecorder::Open (std::string fileName, bool compress)
+{
+  m_piped = compress;
+  if (compress)
+    {
+      // Single quoted for the shell, a quote in the name becomes '\''
+      std::string quoted = "'";
+      for (char c : fileName + ".gz")
+        {
+          quoted += (c == '\'') ? std::string ("'\\''") : std::string (1, c);
+        }
+      std::string command = "gzip -c > " + quoted + "'";
+      m_file = popen (command.c_str (), "w");
+    }
+  else
+    {
+      m_file = fopen (fileName.c_str (), "wb");
+    }
+  NS_ABORT_MSG_IF (m_file == 0, "Cannot open trajectory file " << fileName);
+  fwrite ("NS3TRJ1\n", 1, 8, m_file);
+}
+
+void
+TrajectoryRecorder::Close (void)
+{
+  if (m_file == 0) return;
+  Flush ();
+  if (m_piped)
+    {
+      pclose (m_file);
+    }
+  else
+    {
+      fclose (m_file);
+    }
+  m_file = 0;
+}
+
+bool
+TrajectoryRecorder::IsOpen (void) const
+{
+  return m_file != 0;
+}
+
+std::vector<float>
+TrajectoryRecorder::GetValues (Ptr<OpenGymDataContainer> container)
+{
+  std::vector<float> values;
+  Ptr<OpenGymBoxContainer<uint32_t> > uintBox = DynamicCast<OpenGymBoxContainer<uint32_t> > (container);
+  Ptr<OpenGymBoxContainer<float> > floatBox = DynamicCast<OpenGymBoxContainer<float> > (container);
+  Ptr<OpenGymDiscreteContainer> discrete = DynamicCast<OpenGymDiscreteContainer> (container);
+  if (uintBox != 0)
+    {
+      for (uint32_t value : uintBox->GetData ())
+        {
+          values.push_back (value);
+        }
+    }
+  else if (floatBox != 0)
+    {
+      values = floatBox->GetData ();
+    }
+  else if (discrete != 0)
+    {
+      values.push_back (discrete->GetValue ());
+    }
+  return values;
+}
+
+void
+TrajectoryRecorder::WriteValues (const std::vector<float> &values)
+{
+  uint32_t count = values.size ();
+  fwrite (&count, sizeof (count), 1, m_file);
+  if (count > 0)
+    {
+      fwrite (values.data (), sizeof (float), count, m_file);
+    }
+}
+
+void
+TrajectoryRecorder::Flush (void)
+{
+  if (!m_pending || m_file == 0) return;
+  uint8_t done = m_done;
+  fwrite (&m_step, sizeof (m_step), 1, m_file);
+  fwrite (&m_time, sizeof (m_time), 1, m_file);
+  fwrite (&done, sizeof (done), 1, m_file);
+  fwrite (&m_reward, sizeof (m_reward), 1, m_file);
+  WriteValues (m_observation);
+  WriteValues (m_action);
+  m_action.clear ();
+  m_pending = false;
+  m_step ++;
+}
+
+// A new observation starts a new step, a step whose action never came is written without one
+void
+TrajectoryRecorder::RecordObservation (Ptr<OpenGymDataContainer> observation)
+{
+  if (m_file == 0) return;
+  Flush ();
+  m_pending = true;
+  m_time = Simulator::Now ().GetSeconds ();
+  m_observation = GetValues (observation);
+}
+
+void
+TrajectoryRecorder::RecordReward (float reward)
+{
+  m_reward = reward;
+}
+
+void
+TrajectoryRecorder::RecordGameOver (bool done)
+{
+  m_done = done;
+}
+
+void
+TrajectoryRecorder::RecordAction (Ptr<OpenGymDataContainer> action)
+{
+  if (m_file == 0 || !m_pending) return;
+  m_action = GetValues (action);
+  Flush ();
+}
+
+TrajectoryRecorder trajectory;
+std::string trajectory_file = "";
+bool trajectory_compress = false;
+
+// Who chooses the actions: "gym" waits for an ns3gym agent, "random" samples the
+// action space and "scripted" rotates through servers / keeps links at their best setting
+std::string agent_mode = "gym";
+
+uint32_t gym_steps = 0;
+bool gym_over = false;
+
+bool MyGetGameOver(void)
+{
+  gym_steps ++;
+  if (GameOverTime () > 0 && Simulator::Now () >= Seconds (GameOverTime ()))
+    {
+      gym_over = true;
+    }
+  if (convergence_monitor.HasConverged ())
+    {
+      gym_over = true;
+    }
+  if (max_steps > 0 && gym_steps >= max_steps)
+    {
+      gym_over = true;
+    }
+  NS_LOG_UNCOND ("MyGetGameOver: " << gym_over);
+  trajectory.RecordGameOver (gym_over);
+  return gym_over;
+}
+
+
+Ptr<OpenGymDataContainer> MyGetObservation(void)
+{
+  //Define the base observation space
+  uint32_t nodeNum = nodesPerCluster;
+
+  std::vector<uint32_t> shape = {nodeNum,};
+  Ptr<OpenGymBoxContainer<uint32_t> > box = CreateObject<OpenGymBoxContainer<uint32_t> >(shape);
+  
+    for (uint32_t i=0; i<nodeNum; i++)
+    {
+      Ptr<Node> node = NodeList::GetNode(i);
+
+        //Extract the position from the hierarchy 2 nodes
+      if (mobility_mode == "batched")
+        {
+          box->AddValue(batched_mobility.GetX (node->GetObject<BatchedMobilityModel>()->GetIndex ()));
+          continue;
+        }
+      Ptr<MobilityModel> cpMob = node->GetObject<MobilityModel>();
+      Vector m_position = cpMob->GetPosition();
+      box->AddValue(m_position.x);
+      
+    }
+  NS_LOG_UNCOND ("MyGetObservation: " << box);
+  trajectory.RecordObservation (box);
+  return box;
+}
+
+float MyGetReward(void)
+{
+  float reward = reward_engine.Compute ();
+  trajectory.RecordReward (reward);
+  return reward;
+}
+
+// Points every echo client of the given cluster to one of the cluster 0 servers
+void SetClusterServer(uint32_t cluster, uint32_t server)
+{
+  if (cluster >= steerable_clients.size() || server >= (uint32_t)nodesPerCluster) return;
+  Address serverAddress = server_addresses[server];
+  for (const auto &client : steerable_clients[cluster])
+    {
+      client->SetRemote (serverAddress, echoPort);
+    }
+}
+
+// Sets the DataRate of both ends of a head-to-head link
+void SetHeadLinkRate(uint32_t link, double rateMbps)
+{
+  rateMbps = std::min (std::max (rateMbps, min_link_rate), max_link_rate);
+  for (uint32_t end = 0; end < clusterConnectionDevices[link].GetN (); end++)
+    {
+      Ptr<PointToPointNetDevice> device = DynamicCast<PointToPointNetDevice> (clusterConnectionDevices[link].Get (end));
+      device->SetDataRate (DataRate ((uint64_t)(rateMbps * 1e6)));
+    }
+}
+
+// Sets the routing metric of both ends of a head-to-head link, returns whether it changed
+bool SetHeadLinkMetric(uint32_t link, uint16_t metric)
+{
+  bool changed = false;
+  metric = std::min<uint16_t> (std::max<uint16_t> (metric, 1), max_path_metric);
+  for (uint32_t end = 0; end < clusterConnectionDevices[link].GetN (); end++)
+    {
+      Ptr<NetDevice> device = clusterConnectionDevices[link].Get (end);
+      Ptr<Ipv4> ipv4 = device->GetNode ()->GetObject<Ipv4> ();
+      int32_t interface = ipv4->GetInterfaceForDevice (device);
+      if (ipv4->GetMetric (interface) != metric)
+        {
+          ipv4->SetMetric (interface, metric);
+          changed = true;
+        }
+    }
+  return changed;
+}
+
+bool MyExecuteActions(Ptr<OpenGymDataContainer> action)
+{
+  NS_LOG_UNCOND ("MyExecuteActions: " << action);
+  trajectory.RecordAction (action);
+  if (action_mode == "rate")
+    {
+      Ptr<OpenGymBoxContainer<float> > box = DynamicCast<OpenGymBoxContainer<float> >(action);
+      if (box == 0) return false;
+      std::vector<float> rates = box->GetData ();
+      for (uint32_t link = 0; link < rates.size () && link < clusterConnectionDevices.size (); link++)
+        {
+          SetHeadLinkRate (link, rates[link]);
+        }
+    }
+  else if (action_mode == "path")
+    {
+      Ptr<OpenGymBoxContainer<uint32_t> > box = DynamicCast<OpenGymBoxContainer<uint32_t> >(action);
+      if (box == 0) return false;
+      std::vector<uint32_t> metrics = box->GetData ();
+      bool changed = false;
+      for (uint32_t link = 0; link < metrics.size () && link < clusterConnectionDevices.size (); link++)
+        {
+          changed |= SetHeadLinkMetric (link, metrics[link]);
+        }
+      if (changed && global_routing)
+        {
+          RecomputeGlobalRoutes ();
+        }
+    }
+  else
+    {
+      Ptr<OpenGymBoxContainer<uint32_t> > box = DynamicCast<OpenGymBoxContainer<uint32_t> >(action);
+      if (box == 0) return false;
+      std::vector<uint32_t> servers = box->GetData ();
+      for (uint32_t i = 0; i < servers.size (); i++)
+        {
+          SetClusterServer (i + 1, servers[i]);
+        }
+    }
+  return true;
+}
+
+Ptr<OpenGymInterface> gym_interface;
+Ptr<UniformRandomVariable> policy_random;
+EventId pending_step;
+uint32_t packets_since_step = 0;
+bool latency_above_threshold = false;
+
+// Action of the built-in policies, shaped like MyGetActionSpace
+Ptr<OpenGymDataContainer> PolicyAction(void)
+{
+  bool random = (agent_mode == "random");
+  uint32_t headLinks = clusterConnectionDevices.size();
+  if (action_mode == "rate")
+    {
+      std::vector<uint32_t> shape = {headLinks,};
+      Ptr<OpenGymBoxContainer<float> > box = CreateObject<OpenGymBoxContainer<float> >(shape);
+      for (uint32_t link = 0; link < headLinks; link++)
+        {
+          box->AddValue (random ? policy_random->GetValue (min_link_rate, max_link_rate) : max_link_rate);
+        }
+      return box;
+    }
+  std::vector<uint32_t> shape;
+  uint32_t low, high;
+  if (action_mode == "path")
+    {
+      shape = {headLinks,};
+      low = 1;
+      high = max_path_metric;
+    }
+  else
+    {
+      shape = {(uint32_t)maxClusters - 1,};
+      low = 0;
+      high = nodesPerCluster - 1;
+    }
+  Ptr<OpenGymBoxContainer<uint32_t> > box = CreateObject<OpenGymBoxContainer<uint32_t> >(shape);
+  for (uint32_t i = 0; i < shape[0]; i++)
+    {
+      if (random)
+        {
+          box->AddValue (policy_random->GetInteger (low, high));
+        }
+      else
+        {
+          box->AddValue (action_mode == "path" ? low : (gym_steps + i) % nodesPerCluster);
+        }
+    }
+  return box;
+}
+
+// Same sequence of callbacks ns3gym's NotifyCurrentState runs, without an agent attached
+void LocalStep(void)
+{
+  MyGetObservation ();
+  MyGetReward ();
+  bool done = MyGetGameOver ();
+  if (!done)
+    {
+      MyExecuteActions (PolicyAction ());
+    }
+}
+
+void GymStep(std::string reason)
+{
+  if (gym_over) return;
+  NS_LOG_UNCOND ("GymStep at " << Simulator::Now ().GetSeconds () << "s: " << reason);
+  packets_since_step = 0;
+  if (gym_interface != 0)
+    {
+      gym_interface->NotifyCurrentState();
+    }
+  else
+    {
+      LocalStep ();
+    }
+}
+
+// Triggers coalesce into a single step per simulation instant
+void RequestGymStep(std::string reason)
+{
+  if (gym_over || pending_step.IsRunning ()) return;
+  pending_step = Simulator::ScheduleNow (&GymStep, reason);
+}
+
+void ScheduleNextStateRead(double envStepTime)
+{
+  Simulator::Schedule (Seconds(envStepTime), &ScheduleNextStateRead, envStepTime);
+  if (skip_quiet_steps && packets_since_step == 0 && Simulator::Now () > Seconds (0)) return;
+  RequestGymStep ("interval");
+}
+
+void OnLatencySample(double latency, uint32_t bytes, uint32_t flow, Time sent)
+{
+  reward_engine.OnReceived (latency, bytes, flow, sent);
+  convergence_monitor.OnReceived (latency, bytes, true);
+  OnMetricsSample (latency, bytes);
+  packets_since_step ++;
+  if (step_every_packets > 0 && packets_since_step >= step_every_packets)
+    {
+      RequestGymStep ("packets");
+    }
+  if (step_latency_threshold > 0)
+    {
+      bool above = latency > step_latency_threshold;
+      if (above && !latency_above_threshold)
+        {
+          RequestGymStep ("latency");
+        }
+      latency_above_threshold = above;
+    }
+}
+
+void OnHeadQueueChange(uint32_t oldValue, uint32_t newValue)
+{
+  if (oldValue <= step_queue_threshold && newValue > step_queue_threshold)
+    {
+      RequestGymStep ("queue");
+    }
+}
+
+// Watches the transmit queue of both ends of every head-to-head link
+void ConnectQueueTriggers(void)
+{
+  for (const auto &link : clusterConnectionDevices)
+    {
+      for (uint32_t end = 0; end < link.GetN (); end++)
+        {
+          Ptr<PointToPointNetDevice> device = DynamicCast<PointToPointNetDevice> (link.Get (end));
+          device->GetQueue ()->TraceConnectWithoutContext ("PacketsInQueue", MakeCallback (&OnHeadQueueChange));
+        }
+    }
+}
+
+/*
+ * Queue telemetry of the head-to-head links, one slot per link end (link*2 +
+ * end). Drops, sojourn times and occupancy are accumulated by trace sinks
+ * bound to the slot, so the peak is exact even when no telemetry file is
+ * written and the per packet cost is a few additions. The queue disc reports
+ * its own sojourn times; the device queue is a FIFO, so its sojourn comes
+ * from the enqueue times kept in the same order as the packets.
+ */
+struct HeadQueueStats
+{
+  uint64_t deviceDrops;
+  uint64_t discDrops;
+  uint64_t dequeued;
+  double sojournSum;
+  double sojournMax;
+  uint64_t deviceDequeued;
+  double deviceSojournSum;
+  double deviceSojournMax;
+  uint32_t devicePackets;
+  uint32_t discPackets;
+  uint32_t peakPackets;
+};
+
+std::string head_link_rate = "5Mbps";
+std::string head_link_delay = "2ms";
+std::string head_link_queue = "100p";
+std::string head_queue_disc = "default";   // default keeps what addressing installs, pfifo, fqcodel or pie
+std::string queue_telemetry_file = "";
+double queue_sample_interval = 0.1;
+std::vector<HeadQueueStats> head_queue_stats;
+std::vector< std::deque<Time> > head_device_enqueued;
+std::vector< Ptr<QueueDisc> > head_queue_discs;
+std::ofstream queue_telemetry;
+
+void OnHeadDeviceDrop(uint32_t slot, Ptr<const Packet> packet)
+{
+  head_queue_stats[slot].deviceDrops ++;
+}
+
+void OnHeadDiscDrop(uint32_t slot, Ptr<const QueueDiscItem> item)
+{
+  head_queue_stats[slot].discDrops ++;
+}
+
+void OnHeadSojourn(uint32_t slot, Time sojourn)
+{
+  HeadQueueStats &stats = head_queue_stats[slot];
+  stats.dequeued ++;
+  stats.sojournSum += sojourn.GetSeconds ();
+  stats.sojournMax = std::max (stats.sojournMax, sojourn.GetSeconds ());
+}
+
+void OnHeadDeviceEnqueue(uint32_t slot, Ptr<const Packet> packet)
+{
+  head_device_enqueued[slot].push_back (Simulator::Now ());
+}
+
+void OnHeadDeviceDequeue(uint32_t slot, Ptr<const Packet> packet)
+{
+  HeadQueueStats &stats = head_queue_stats[slot];
+  std::deque<Time> &enqueued = head_device_enqueued[slot];
+  if (enqueued.empty ()) return;
+  double sojourn = (Simulator::Now () - enqueued.front ()).GetSeconds ();
+  enqueued.pop_front ();
+  stats.deviceDequeued ++;
+  stats.deviceSojournSum += sojourn;
+  stats.deviceSojournMax = std::max (stats.deviceSojournMax, sojourn);
+}
+
+// Packets dropped after they were dequeued leave the FIFO as well
+void OnHeadDeviceDropAfterDequeue(uint32_t slot, Ptr<const Packet> packet)
+{
+  if (!head_device_enqueued[slot].empty ())
+    {
+      head_device_enqueued[slot].pop_front ();
+    }
+}
+
+void OnHeadDevicePackets(uint32_t slot, uint32_t oldValue, uint32_t newValue)
+{
+  HeadQueueStats &stats = head_queue_stats[slot];
+  stats.devicePackets = newValue;
+  stats.peakPackets = std::max (stats.peakPackets, stats.devicePackets + stats.discPackets);
+}
+
+void OnHeadDiscPackets(uint32_t slot, uint32_t oldValue, uint32_t newValue)
+{
+  HeadQueueStats &stats = head_queue_stats[slot];
+  stats.discPackets = newValue;
+  stats.peakPackets = std::max (stats.peakPackets, stats.devicePackets + stats.discPackets);
+}
+
+Ptr<PointToPointNetDevice> HeadLinkDevice(uint32_t slot)
+{
+  return DynamicCast<PointToPointNetDevice> (clusterConnectionDevices[slot / 2].Get (slot % 2));
+}
+
+// Writes time,link,end,devicePackets,discPackets,deviceDrops,discDrops,meanSojourn,maxSojourn,meanDeviceSojourn,maxDeviceSojourn
+void SampleHeadQueues(void)
+{
+  for (uint32_t slot = 0; slot < head_queue_stats.size (); slot++)
+    {
+      const HeadQueueStats &stats = head_queue_stats[slot];
+      queue_telemetry << Simulator::Now ().GetSeconds () << "," << slot / 2 << "," << slot % 2
+                      << "," << stats.devicePackets << "," << stats.discPackets
+                      << "," << stats.deviceDrops << "," << stats.discDrops
+                      << "," << (stats.dequeued > 0 ? stats.sojournSum / stats.dequeued : 0.0)
+                      << "," << stats.sojournMax
+                      << "," << (stats.deviceDequeued > 0 ? stats.deviceSojournSum / stats.deviceDequeued : 0.0)
+                      << "," << stats.deviceSojournMax << "\n";
+    }
+  Simulator::Schedule (Seconds (queue_sample_interval), &SampleHeadQueues);
+}
+
+void ConnectQueueTelemetry(void)
+{
+  HeadQueueStats empty = {0, 0, 0, 0.0, 0.0, 0, 0.0, 0.0, 0, 0, 0};
+  head_queue_stats.assign (clusterConnectionDevices.size () * 2, empty);
+  head_device_enqueued.assign (clusterConnectionDevices.size () * 2, std::deque<Time> ());
+  head_queue_discs.assign (clusterConnectionDevices.size () * 2, Ptr<QueueDisc> ());
+  for (uint32_t slot = 0; slot < head_queue_stats.size (); slot++)
+    {
+      Ptr<PointToPointNetDevice> device = HeadLinkDevice (slot);
+      device->GetQueue ()->TraceConnectWithoutContext ("Drop", MakeBoundCallback (&OnHeadDeviceDrop, slot));
+      device->GetQueue ()->TraceConnectWithoutContext ("Enqueue", MakeBoundCallback (&OnHeadDeviceEnqueue, slot));
+      device->GetQueue ()->TraceConnectWithoutContext ("Dequeue", MakeBoundCallback (&OnHeadDeviceDequeue, slot));
+      device->GetQueue ()->TraceConnectWithoutContext ("DropAfterDequeue",
+                                                       MakeBoundCallback (&OnHeadDeviceDropAfterDequeue, slot));
+      device->GetQueue ()->TraceConnectWithoutContext ("PacketsInQueue", MakeBoundCallback (&OnHeadDevicePackets, slot));
+      Ptr<TrafficControlLayer> trafficControl = device->GetNode ()->GetObject<TrafficControlLayer> ();
+      Ptr<QueueDisc> disc = trafficControl ? trafficControl->GetRootQueueDiscOnDevice (device) : 0;
+      if (disc)
+        {
+          disc->TraceConnectWithoutContext ("Drop", MakeBoundCallback (&OnHeadDiscDrop, slot));
+          disc->TraceConnectWithoutContext ("SojournTime", MakeBoundCallback (&OnHeadSojourn, slot));
+          disc->TraceConnectWithoutContext ("PacketsInQueue", MakeBoundCallback (&OnHeadDiscPackets, slot));
+          head_queue_discs[slot] = disc;
+        }
+    }
+  if (queue_telemetry_file != "")
+    {
+      queue_telemetry.open (queue_telemetry_file.c_str ());
+      NS_ABORT_MSG_IF (!queue_telemetry.is_open (), "Cannot open queue telemetry file " << queue_telemetry_file);
+      queue_telemetry << "Time,Link,End,DevicePackets,DiscPackets,DeviceDrops,DiscDrops,MeanSojourn,MaxSojourn"
+                      << ",MeanDeviceSojourn,MaxDeviceSojourn" << std::endl;
+      Simulator::Schedule (Seconds (queue_sample_interval), &SampleHeadQueues);
+    }
+}
+
+void ReportQueueTelemetry(void)
+{
+  for (uint32_t slot = 0; slot < head_queue_stats.size (); slot++)
+    {
+      const HeadQueueStats &stats = head_queue_stats[slot];
+      if (stats.dequeued == 0 && stats.deviceDequeued == 0 && stats.deviceDrops == 0 && stats.discDrops == 0) continue;
+      NS_LOG_UNCOND ("Head link " << slot / 2 << " end " << slot % 2 << ": " << stats.deviceDrops + stats.discDrops
+                     << " drops, disc sojourn mean " << (stats.dequeued > 0 ? stats.sojournSum / stats.dequeued : 0.0)
+                     << "s max " << stats.sojournMax << "s, device sojourn mean "
+                     << (stats.deviceDequeued > 0 ? stats.deviceSojournSum / stats.deviceDequeued : 0.0)
+                     << "s max " << stats.deviceSojournMax << "s, peak " << stats.peakPackets << " packets");
+    }
+  if (queue_telemetry.is_open ())
+    {
+      queue_telemetry.close ();
+    }
+}
+
+/*
+ * Gauges and cumulative counters of the metrics export, refreshed from the
+ * event loop every metrics_interval of simulated time. Packet counters and
+ * the latency histogram are updated per packet in OnMetricsSample.
+ */
+struct MetricsGauges
+{
+  Metric *simTime;
+  Metric *events;
+  Metric *eventRate;
+  Metric *queuedPackets;
+  Metric *peakQueue;
+  Metric *queueDrops;
+  uint64_t lastEvents;
+  std::chrono::steady_clock::time_point lastWall;
+};
+
+MetricsGauges metrics_gauges;
+
+void SampleMetrics(void)
+{
+  MetricsGauges &gauges = metrics_gauges;
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now ();
+  uint64_t events = Simulator::GetEventCount ();
+  double wall = std::chrono::duration<double> (now - gauges.lastWall).count ();
+  if (wall > 0)
+    {
+      gauges.eventRate->Set ((events - gauges.lastEvents) / wall);
+    }
+  gauges.lastEvents = events;
+  gauges.lastWall = now;
+  gauges.simTime->Set (Simulator::Now ().GetSeconds ());
+  gauges.events->Set (events);   // counters take the running totals kept elsewhere
+  uint32_t queued = 0;
+  uint32_t peak = 0;
+  uint64_t drops = 0;
+  for (uint32_t slot = 0; slot < head_queue_stats.size (); slot++)
+    {
+      uint32_t packets = HeadLinkDevice (slot)->GetQueue ()->GetNPackets ()
+        + (head_queue_discs[slot] ? head_queue_discs[slot]->GetNPackets () : 0);
+      queued += packets;
+      peak = std::max (peak, packets);
+      drops += head_queue_stats[slot].deviceDrops + head_queue_stats[slot].discDrops;
+    }
+  gauges.queuedPackets->Set (queued);
+  gauges.peakQueue->Set (peak);
+  gauges.queueDrops->Set (drops);
+  Simulator::Schedule (Seconds (metrics_interval), &SampleMetrics);
+}
+
+// Registers the metrics and starts serving them, nothing when no endpoint is set
+void StartMetrics(void)
+{
+  if (metrics_socket == "" && metrics_port == 0) return;
+  NS_ABORT_MSG_IF (metrics_interval <= 0, "metricsInterval must be positive");
+  metric_packets = live_metrics.AddCounter ("manet_packets_received_total", "Application packets received");
+  metric_bytes = live_metrics.AddCounter ("manet_bytes_received_total", "Application bytes received");
+  metric_latency = live_metrics.AddHistogram ("manet_latency_seconds", "End to end latency of received packets",
+                                         {0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1, 2, 5});
+  MetricsGauges &gauges = metrics_gauges;
+  gauges.simTime = live_metrics.AddGauge ("manet_sim_time_seconds", "Current simulated time");
+  gauges.events = live_metrics.AddCounter ("manet_events_total", "Events executed by the scheduler");
+  gauges.eventRate = live_metrics.AddGauge ("manet_events_per_second", "Events executed per wall clock second since the last sample");
+  gauges.queuedPackets = live_metrics.AddGauge ("manet_head_queue_packets", "Packets queued on all head link ends");
+  gauges.peakQueue = live_metrics.AddGauge ("manet_head_queue_max_packets", "Packets queued on the fullest head link end");
+  gauges.queueDrops = live_metrics.AddCounter ("manet_head_queue_drops_total", "Packets dropped by head link queues and queue discs");
+  gauges.lastEvents = 0;
+  gauges.lastWall = std::chrono::steady_clock::now ();
+  live_metrics.Serve (metrics_socket, metrics_port);
+  Simulator::ScheduleNow (&SampleMetrics);
+  NS_LOG_UNCOND ("Serving metrics" << (metrics_socket != "" ? " on " + metrics_socket : "")
+                 << (metrics_port != 0 ? " on http://127.0.0.1:" + std::to_string (metrics_port) + "/metrics" : ""));
+}
+
+void StopMetrics(void)
+{
+  live_metrics.Shutdown ();
+}
+
+/*
+ * Clustering engine. Each round regroups the mobile members around the
+ * current cluster heads (a member joins the nearest head) and then elects,
+ * per group, the member the head should sit next to:
+ *   lowest-id       the member with the lowest node id
+ *   highest-degree  the member with most group neighbours within clusterRange
+ *   weighted        lowest weightDegree*|degree - ideal| + weightDistance*mean distance
+ * Election is position only: the head node is moved onto the elected
+ * member, so heads follow their members and the next round groups around
+ * the new positions, but no member takes the head role. Point to point
+ * latency does not depend on position, so in p2p mode election changes the
+ * grouping and nothing else; only the wireless mode sees shorter hops.
+ * Only members that changed group are rewired: a link to the new head is
+ * brought up (created on first use) and the link to the previous head,
+ * home included, is set down, then global routes are recomputed once. A
+ * member is reached at the address of its current link, so the echo
+ * clients and generators aimed at it are pointed at the new address.
+ * Applications keep their home cluster in clusters[]; member_cluster[]
+ * tracks the current grouping.
+ */
+std::string cluster_policy = "lowest-id";
+double recluster_interval = 0.0;     // seconds, 0 runs no periodic rounds
+double cluster_range = 30.0;         // meters, neighbourhood of the degree policies
+double weight_degree = 1.0;
+double weight_distance = 0.1;
+
+std::map<uint32_t, uint32_t> member_cluster;                                   // node id -> cluster
+std::map<uint32_t, uint32_t> elected_member;                                   // cluster -> node id
+std::map<std::pair<uint32_t, uint32_t>, NetDeviceContainer> member_head_links; // (node id, cluster) -> link
+int next_subnet = 1;
+uint32_t recluster_rounds = 0;
+uint32_t member_churn = 0;
+uint32_t head_churn = 0;
+
+std::string getBaseIP(int clusterId);
+
+void SetMemberLinkUp(uint32_t nodeId, uint32_t cluster, bool up)
+{
+  NetDeviceContainer link = member_head_links[std::make_pair (nodeId, cluster)];
+  for (uint32_t end = 0; end < link.GetN (); end++)
+    {
+      Ptr<NetDevice> device = link.Get (end);
+      Ptr<Ipv4> ipv4 = device->GetNode ()->GetObject<Ipv4> ();
+      int32_t interface = ipv4->GetInterfaceForDevice (device);
+      if (up)
+        {
+          ipv4->SetUp (interface);
+        }
+      else
+        {
+          ipv4->SetDown (interface);
+        }
+    }
+}
+
+// Member end address of the link between a member and the head of a cluster
+Ipv4Address MemberLinkAddress(uint32_t nodeId, uint32_t cluster)
+{
+  Ptr<NetDevice> device = member_head_links[std::make_pair (nodeId, cluster)].Get (0);
+  Ptr<Ipv4> ipv4 = device->GetNode ()->GetObject<Ipv4> ();
+  return ipv4->GetAddress (ipv4->GetInterfaceForDevice (device), 0).GetLocal ();
+}
+
+// Points the servers list, echo clients and generators aimed at a moved member to its new address
+void ReaddressMember(Ipv4Address from, Ipv4Address to)
+{
+  for (auto &server : server_addresses)
+    {
+      if (server == from) server = to;
+    }
+  for (const auto &cluster : steerable_clients)
+    {
+      for (const auto &client : cluster)
+        {
+          if (Ipv4Address::IsMatchingType (client->GetRemote ()) && Ipv4Address::ConvertFrom (client->GetRemote ()) == from)
+            {
+              client->SetRemote (to, echoPort);
+            }
+        }
+    }
+  for (const auto &generator : traffic_generators)
+    {
+      if (Ipv4Address::IsMatchingType (generator->GetRemote ()) && Ipv4Address::ConvertFrom (generator->GetRemote ()) == from)
+        {
+          generator->SetRemote (to);
+        }
+    }
+}
+
+// Links a member to the head of another cluster, reusing the link if it was made before
+void RewireMember(Ptr<Node> member, uint32_t home, uint32_t from, uint32_t to)
+{
+  std::pair<uint32_t, uint32_t> key = std::make_pair (member->GetId (), to);
+  if (member_head_links.find (key) == member_head_links.end ())
+    {
+      PointToPointHelper pointToPointInCluster;
+      pointToPointInCluster.SetDeviceAttribute ("DataRate", StringValue ("5Mbps"));
+      pointToPointInCluster.SetChannelAttribute ("Delay", StringValue ("2ms"));
+      NetDeviceContainer devices = pointToPointInCluster.Install (member, clusterHeads[to].Get (0));
+
+      Ipv4AddressHelper address;
+      std::string baseIP = getBaseIP(next_subnet);
+      address.SetBase (baseIP.c_str(), "255.255.255.0");
+      next_subnet ++;
+      Ipv4InterfaceContainer interfaces = address.Assign (devices);
+      member_head_links[key] = devices;
+
+      // Traffic to the new address still belongs to the member's home cluster
+      address_cluster[interfaces.GetAddress (0).Get ()] = home;
+    }
+  else
+    {
+      SetMemberLinkUp (member->GetId (), to, true);
+    }
+  SetMemberLinkUp (member->GetId (), from, false);
+  ReaddressMember (MemberLinkAddress (member->GetId (), from), MemberLinkAddress (member->GetId (), to));
+}
+
+double ElectionScore(Ptr<Node> candidate, const std::vector< Ptr<Node> > &group)
+{
+  if (cluster_policy == "lowest-id")
+    {
+      return candidate->GetId ();
+    }
+  Vector position = candidate->GetObject<MobilityModel> ()->GetPosition ();
+  uint32_t degree = 0;
+  double distanceSum = 0.0;
+  for (const auto &other : group)
+    {
+      if (other == candidate) continue;
+      double distance = CalculateDistance (position, other->GetObject<MobilityModel> ()->GetPosition ());
+      distanceSum += distance;
+      if (distance <= cluster_range) degree ++;
+    }
+  if (cluster_policy == "highest-degree")
+    {
+      // Lower is better, node ids break ties
+      return -(double) degree + candidate->GetId () * 1e-6;
+    }
+  double ideal = nodesPerCluster - 1;
+  double meanDistance = group.size () > 1 ? distanceSum / (group.size () - 1) : 0.0;
+  return weight_degree * std::abs (degree - ideal) + weight_distance * meanDistance;
+}
+
+void Recluster(void)
+{
+  std::vector<Vector> headPositions;
+  for (int cluster = 0; cluster < maxClusters; cluster++)
+    {
+      headPositions.push_back (clusterHeads[cluster].Get (0)->GetObject<MobilityModel> ()->GetPosition ());
+    }
+
+  // Regroup every member around its nearest head
+  std::vector< std::vector< Ptr<Node> > > groups (maxClusters);
+  uint32_t moved = 0;
+  bool rewired = false;
+  for (int home = 0; home < maxClusters; home++)
+    {
+      for (uint32_t node = 0; node < clusters[home].GetN (); node++)
+        {
+          Ptr<Node> member = clusters[home].Get (node);
+          Vector position = member->GetObject<MobilityModel> ()->GetPosition ();
+          uint32_t nearest = member_cluster[member->GetId ()];
+          for (int cluster = 0; cluster < maxClusters; cluster++)
+            {
+              if (CalculateDistance (position, headPositions[cluster]) < CalculateDistance (position, headPositions[nearest]))
+                {
+                  nearest = cluster;
+                }
+            }
+          if (nearest != member_cluster[member->GetId ()])
+            {
+              if (link_mode == "p2p")
+                {
+                  RewireMember (member, home, member_cluster[member->GetId ()], nearest);
+                  rewired = true;
+                }
+              member_cluster[member->GetId ()] = nearest;
+              moved ++;
+            }
+          groups[nearest].push_back (member);
+        }
+    }
+
+  // Elect, per group, the member the head moves next to
+  uint32_t headsChanged = 0;
+  for (int cluster = 0; cluster < maxClusters; cluster++)
+    {
+      if (groups[cluster].empty ()) continue;
+      Ptr<Node> elected = groups[cluster][0];
+      double best = ElectionScore (elected, groups[cluster]);
+      for (const auto &candidate : groups[cluster])
+        {
+          double score = ElectionScore (candidate, groups[cluster]);
+          if (score < best)
+            {
+              best = score;
+              elected = candidate;
+            }
+        }
+      if (elected_member.find (cluster) == elected_member.end () || elected_member[cluster] != elected->GetId ())
+        {
+          elected_member[cluster] = elected->GetId ();
+          headsChanged ++;
+        }
+      Vector position = elected->GetObject<MobilityModel> ()->GetPosition ();
+      clusterHeads[cluster].Get (0)->GetObject<MobilityModel> ()->SetPosition (position);
+    }
+
+  if (rewired && global_routing)
+    {
+      RecomputeGlobalRoutes ();
+    }
+  recluster_rounds ++;
+  member_churn += moved;
+  head_churn += headsChanged;
+  NS_LOG_UNCOND ("Recluster at " << Simulator::Now ().GetSeconds () << "s: " << moved
+                 << " members moved, " << headsChanged << " heads re-elected");
+}
+
+void ScheduleRecluster(double interval)
+{
+  Recluster ();
+  Simulator::Schedule (Seconds (interval), &ScheduleRecluster, interval);
+}
+
+// Initial grouping is the home cluster, wired by SetupPointToPointLinks
+void InitClustering(void)
+{
+  for (int cluster = 0; cluster < maxClusters; cluster++)
+    {
+      for (uint32_t node = 0; node < clusters[cluster].GetN (); node++)
+        {
+          uint32_t nodeId = clusters[cluster].Get (node)->GetId ();
+          member_cluster[nodeId] = cluster;
+          if (link_mode == "p2p")
+            {
+              member_head_links[std::make_pair (nodeId, (uint32_t)cluster)] = intoClusterHeadDevices[cluster][node];
+            }
+        }
+    }
+}
+/*
+ * Displacement triggers. Consumers register a distance per node (or for
+ * every member of a cluster) and are called back once the node has moved
+ * that far since their last notification. On each course change the
+ * crossing time is solved from the current position and velocity, and one
+ * event is scheduled at that time, so nothing polls positions. The event
+ * re-checks the real distance and re-plans when a wall bounce delayed it.
+ */
+class DisplacementTrigger
+{
+public:
+  typedef Callback<void, Ptr<Node>, double> Listener;
+
+  void Watch (Ptr<Node> node, double threshold, Listener listener);
+  void WatchCluster (uint32_t cluster, double threshold, Listener listener);
+
+private:
+  struct Registration
+  {
+    Ptr<Node> node;
+    Ptr<MobilityModel> mobility;
+    double threshold;
+    Vector anchor;
+    EventId event;
+    Listener listener;
+  };
+
+  void CourseChange (Ptr<const MobilityModel> mobility);
+  void Plan (uint32_t index);
+  void Fire (uint32_t index);
+
+  std::vector<Registration> m_registrations;
+  std::multimap<const MobilityModel *, uint32_t> m_byMobility;
+};
+
+void
+DisplacementTrigger::Watch (Ptr<Node> node, double threshold, Listener listener)
+{
+  Ptr<MobilityModel> mobility = node->GetObject<MobilityModel> ();
+  NS_ABORT_MSG_IF (mobility == 0, "Node " << node->GetId () << " has no mobility model");
+  // A zero threshold is crossed again at the instant it fires and never lets time advance
+  NS_ABORT_MSG_IF (!(threshold > 0), "Displacement threshold must be positive, got " << threshold);
+  if (m_byMobility.find (PeekPointer (mobility)) == m_byMobility.end ())
+    {
+      mobility->TraceConnectWithoutContext ("CourseChange", MakeCallback (&DisplacementTrigger::CourseChange, this));
+    }
+
+  Registration registration;
+  registration.node = node;
+  registration.mobility = mobility;
+  registration.threshold = threshold;
+  registration.anchor = mobility->GetPosition ();
+  registration.listener = listener;
+  m_registrations.push_back (registration);
+  m_byMobility.insert (std::make_pair (PeekPointer (mobility), m_registrations.size () - 1));
+  Plan (m_registrations.size () - 1);
+}
+
+void
+DisplacementTrigger::WatchCluster (uint32_t cluster, double threshold, Listener listener)
+{
+  for (uint32_t node = 0; node < clusters[cluster].GetN (); node++)
+    {
+      Watch (clusters[cluster].Get (node), threshold, listener);
+    }
+}
+
+void
+DisplacementTrigger::CourseChange (Ptr<const MobilityModel> mobility)
+{
+  typedef std::multimap<const MobilityModel *, uint32_t>::const_iterator Iterator;
+  std::pair<Iterator, Iterator> range = m_byMobility.equal_range (PeekPointer (mobility));
+  for (Iterator it = range.first; it != range.second; ++it)
+    {
+      Plan (it->second);
+    }
+}
+
+// Solves |position + velocity*t - anchor| = threshold for the first t >= 0
+void
+DisplacementTrigger::Plan (uint32_t index)
+{
+  Registration &registration = m_registrations[index];
+  registration.event.Cancel ();
+
+  Vector offset = registration.mobility->GetPosition () - registration.anchor;
+  Vector velocity = registration.mobility->GetVelocity ();
+  double a = velocity.x * velocity.x + velocity.y * velocity.y + velocity.z * velocity.z;
+  double b = 2.0 * (offset.x * velocity.x + offset.y * velocity.y + offset.z * velocity.z);
+  double c = offset.x * offset.x + offset.y * offset.y + offset.z * offset.z
+             - registration.threshold * registration.threshold;
+  if (c >= 0)
+    {
+      registration.event = Simulator::ScheduleNow (&DisplacementTrigger::Fire, this, index);
+      return;
+    }
+  if (a == 0) return;
+  double t = (-b + std::sqrt (b * b - 4.0 * a * c)) / (2.0 * a);
+  registration.event = Simulator::Schedule (Seconds (t), &DisplacementTrigger::Fire, this, index);
+}
+
+void
+DisplacementTrigger::Fire (uint32_t index)
+{
+  Registration &registration = m_registrations[index];
+  Vector position = registration.mobility->GetPosition ();
+  double moved = CalculateDistance (position, registration.anchor);
+  // Tolerate the rounding of the crossing time to the simulator resolution
+  if (moved >= registration.threshold * (1.0 - 1e-6))
+    {
+      registration.anchor = position;
+      registration.listener (registration.node, moved);
+    }
+  Plan (index);
+}
+
+DisplacementTrigger displacement_trigger;
+bool step_on_movement = false;      // gym step when an observed node moved distance_change meters
+double recluster_distance = 0.0;    // clustering round when a member moved this far, 0 disables
+EventId pending_recluster;
+
+void OnObservedNodeMoved(Ptr<Node> node, double distance)
+{
+  RequestGymStep ("movement");
+}
+
+void OnMemberMoved(Ptr<Node> node, double distance)
+{
+  if (!pending_recluster.IsRunning ())
+    {
+      pending_recluster = Simulator::ScheduleNow (&Recluster);
+    }
+}
+
+void ConnectDisplacementTriggers(void)
+{
+  if (step_on_movement)
+    {
+      // MyGetObservation reports the cluster 0 members
+      displacement_trigger.WatchCluster (0, distance_change, MakeCallback (&OnObservedNodeMoved));
+    }
+  if (recluster_distance > 0)
+    {
+      for (int cluster = 0; cluster < maxClusters; cluster++)
+        {
+          displacement_trigger.WatchCluster (cluster, recluster_distance, MakeCallback (&OnMemberMoved));
+        }
+    }
+}
+/*
+ * Routing comparison statistics. Every IPv4 transmission, at every hop, is
+ * either routing control (UDP to the AODV, OLSR or DSDV port, DSR control
+ * messages) or data. Echo RTTs are split into the first reply of each
+ * client, which pays for any route discovery, and the later replies.
+ */
+uint64_t control_packets = 0;
+uint64_t control_bytes = 0;
+uint64_t data_packets = 0;
+uint64_t data_bytes = 0;
+double first_rtt_sum = 0.0;
+uint32_t first_rtt_count = 0;
+double later_rtt_sum = 0.0;
+uint32_t later_rtt_count = 0;
+
+void OnIpv4Tx(Ptr<const Packet> packet, Ptr<Ipv4> ipv4, uint32_t interface)
+{
+  Ptr<Packet> copy = packet->Copy ();
+  Ipv4Header ipHeader;
+  copy->RemoveHeader (ipHeader);
+  bool control = false;
+  if (ipHeader.GetProtocol () == UdpL4Protocol::PROT_NUMBER)
+    {
+      UdpHeader udpHeader;
+      copy->PeekHeader (udpHeader);
+      uint16_t port = udpHeader.GetDestinationPort ();
+      control = (port == 654 || port == 698 || port == 269);
+    }
+  else if (ipHeader.GetProtocol () == DsrRouting::PROT_NUMBER)
+    {
+      DsrRoutingHeader dsrHeader;
+      copy->PeekHeader (dsrHeader);
+      control = (dsrHeader.GetMessageType () == 1);
+    }
+
+  if (control)
+    {
+      control_packets ++;
+      control_bytes += packet->GetSize ();
+    }
+  else
+    {
+      data_packets ++;
+      data_bytes += packet->GetSize ();
+    }
+}
+
+void OnEchoReply(bool first, double rtt)
+{
+  if (first)
+    {
+      first_rtt_sum += rtt;
+      first_rtt_count ++;
+    }
+  else
+    {
+      later_rtt_sum += rtt;
+      later_rtt_count ++;
+    }
+}
+
+RoutingExperiment::RoutingExperiment ()
+  : port (9),
+    bytesTotal (0),
+    packetsReceived (0),
+    m_CSVfileName ("manet-simulation.output.csv"),
+    m_traceMobility (false),
+    m_protocol (0), // Global routing
+    m_reportFileName ("manet-routing-report.csv")
+{
+}
+
+std::string
+RoutingExperiment::CommandSetup (int argc, char **argv)
+{
+  CommandLine cmd (__FILE__);
+  cmd.AddValue ("CSVfileName", "The name of the CSV output file name", m_CSVfileName);
+  cmd.AddValue ("traceMobility", "Enable mobility tracing", m_traceMobility);
+  cmd.AddValue ("protocol", "0=Global;1=OLSR;2=AODV;3=DSDV;4=DSR", m_protocol);
+  cmd.AddValue ("reportFile", "CSV the routing comparison row of this run is appended to", m_reportFileName);
+  cmd.AddValue ("nodesPerCluster", "Number of mobile members per cluster", nodesPerCluster);
+  cmd.AddValue ("clusters", "Number of clusters", maxClusters);
+  cmd.AddValue ("actionMode", "Gym action: server=pick cluster 0 server per client cluster;rate=head link DataRate;path=head link routing metric", action_mode);
+  cmd.AddValue ("minLinkRate", "Lowest head link DataRate (Mbps) a rate action may set", min_link_rate);
+  cmd.AddValue ("maxLinkRate", "Highest head link DataRate (Mbps) a rate action may set", max_link_rate);
+  cmd.AddValue ("maxPathMetric", "Highest head link routing metric a path action may set", max_path_metric);
+  cmd.AddValue ("stepTime", "Seconds between timed gym steps, 0 disables timed steps", step_interval);
+  cmd.AddValue ("skipQuietSteps", "Skip timed gym steps when no reply arrived since the last step", skip_quiet_steps);
+  cmd.AddValue ("stepEveryPackets", "Take a gym step every N echo replies, 0 disables", step_every_packets);
+  cmd.AddValue ("stepLatency", "Take a gym step when a reply RTT rises above this many seconds, 0 disables", step_latency_threshold);
+  cmd.AddValue ("stepQueue", "Take a gym step when a head link queue rises above this many packets, 0 disables", step_queue_threshold);
+  cmd.AddValue ("simTime", "Seconds after which the gym episode is over, 0 disables, negative follows the run end", game_over_time);
+  cmd.AddValue ("reward", "Gym reward as metric[:weight],... over mean,max,p50,p90,p95,p99,jitter,goodput,loss,received", reward_spec);
+  cmd.AddValue ("agent", "Who picks the actions: gym=ns3gym agent;random=sample the action space;scripted=fixed rotation", agent_mode);
+  cmd.AddValue ("trajectoryFile", "Record (observation, action, reward, done) of every step to this binary file", trajectory_file);
+  cmd.AddValue ("trajectoryCompress", "Pipe the trajectory file through gzip", trajectory_compress);
+  cmd.AddValue ("mobility", "walk=one RandomWalk2dMobilityModel per node;batched=array based walk advanced in one tick", mobility_mode);
+  cmd.AddValue ("mobilityTrace", "Replay member mobility from this binary waypoint trace", mobility_trace_file);
+  cmd.AddValue ("mobilityTick", "Seconds between position updates of the batched mobility", mobility_tick);
+  cmd.AddValue ("linkMode", "p2p=point to point cluster links;wireless=ad hoc channel with AODV", link_mode);
+  cmd.AddValue ("wirelessRange", "Interference range (m) of the wireless mode", wireless_range);
+  cmd.AddValue ("clusterPolicy", "Head election: lowest-id, highest-degree or weighted", cluster_policy);
+  cmd.AddValue ("reclusterInterval", "Seconds between clustering rounds, 0 disables", recluster_interval);
+  cmd.AddValue ("clusterRange", "Neighbourhood radius (m) of the degree based policies", cluster_range);
+  cmd.AddValue ("weightDegree", "Weight of the degree difference in the weighted policy", weight_degree);
+  cmd.AddValue ("weightDistance", "Weight of the mean member distance in the weighted policy", weight_distance);
+  cmd.AddValue ("stepOnMovement", "Take a gym step when an observed node moved distanceChange meters", step_on_movement);
+  cmd.AddValue ("distanceChange", "Displacement (m) of an observed node that triggers a gym step", distance_change);
+  cmd.AddValue ("reclusterDistance", "Run a clustering round when a member moved this many meters, 0 disables", recluster_distance);
+  cmd.AddValue ("traffic", "echo=steerable echo clients;generator=high rate traffic generators", traffic_mode);
+  cmd.AddValue ("trafficPattern", "Generator pattern: cbr, poisson, onoff or bursty", traffic_pattern);
+  cmd.AddValue ("trafficRate", "Mean rate of every generator", traffic_rate);
+  cmd.AddValue ("trafficMatrix", "Generator flows: fanin, hotspot[:cluster], all-to-all, gravity or csv:file", traffic_matrix);
+  cmd.AddValue ("trafficPacketSize", "Generator packet size, smallest size when trafficMaxPacketSize is larger", traffic_packet_size);
+  cmd.AddValue ("trafficMaxPacketSize", "Largest generator packet size, 0 keeps sizes fixed", traffic_max_packet_size);
+  cmd.AddValue ("sinkDumpFile", "Write per flow sink counters and delay histograms to this CSV", sink_dump_file);
+  cmd.AddValue ("sinkDumpInterval", "Seconds between sink dumps", sink_dump_interval);
+  cmd.AddValue ("clusterMatrixFile", "Write the cluster to cluster delay/jitter/loss/goodput matrix to this CSV", cluster_matrix_file);
+  cmd.AddValue ("clusterMatrixInterval", "Seconds between cluster matrix rows, 0 writes the run total only", cluster_matrix_interval);
+  cmd.AddValue ("echoProcessingTime", "Seconds the echo servers hold each request before replying", echo_processing_time);
+  cmd.AddValue ("headLinkRate", "DataRate of the head-to-head links", head_link_rate);
+  cmd.AddValue ("headLinkDelay", "Delay of the head-to-head links", head_link_delay);
+  cmd.AddValue ("headLinkQueue", "Device queue size of the head-to-head links", head_link_queue);
+  cmd.AddValue ("headQueueDisc", "Queue disc of the head-to-head links: default, pfifo, fqcodel or pie", head_queue_disc);
+  cmd.AddValue ("queueTelemetryFile", "Sample head link queue occupancy, drops and sojourn times into this CSV", queue_telemetry_file);
+  cmd.AddValue ("queueSampleInterval", "Seconds between head link queue samples", queue_sample_interval);
+  cmd.AddValue ("headAggregation", "Coalesce packets on the head-to-head links into larger frames", head_aggregation);
+  cmd.AddValue ("aggregationSize", "Bytes after which an aggregated frame is sent", aggregation_size);
+  cmd.AddValue ("aggregationDelay", "Seconds a packet may wait for its aggregated frame", aggregation_delay);
+  cmd.AddValue ("headCache", "Answer repeated echo requests from a cache on the cluster heads", head_cache);
+  cmd.AddValue ("headCacheCapacity", "Entries of each head cache", head_cache_capacity);
+  cmd.AddValue ("headCacheTtl", "Seconds a cached echo reply is served", head_cache_ttl);
+  cmd.AddValue ("clusterMulticast", "Disseminate from a cluster 0 member to every other cluster over static multicast routes", cluster_multicast);
+  cmd.AddValue ("multicastRate", "Rate of each cluster multicast stream", multicast_rate);
+  cmd.AddValue ("headsPerCluster", "Heads per cluster, members link to all of them", heads_per_cluster);
+  cmd.AddValue ("headBalance", "How members spread flows over their heads: ecmp or weighted", head_balance);
+  cmd.AddValue ("headWeights", "Comma separated weight of each head for weighted balance", head_weights);
+  cmd.AddValue ("scheduler", "Event scheduler: map, list, heap, calendar, priority or wheel", scheduler_type);
+  cmd.AddValue ("duration", "Seconds of simulated time of a run without convergence monitoring", sim_duration);
+  cmd.AddValue ("convergence", "Stop once these metrics converge: throughput,mean,p50,p90,p99; empty runs for duration", convergence_metrics);
+  cmd.AddValue ("precision", "Relative 95% confidence half width every convergence metric must reach", convergence_precision);
+  cmd.AddValue ("batchInterval", "Seconds per batch of the batch means", batch_interval);
+  cmd.AddValue ("warmupBatches", "Batches discarded before batch means start", warmup_batches);
+  cmd.AddValue ("minBatches", "Batches needed before convergence is tested", min_batches);
+  cmd.AddValue ("maxSimTime", "Seconds a run that has not converged may extend to", max_sim_time);
+  cmd.AddValue ("routeCache", "Directory of cached global routes, reused by runs with the same topology", route_cache_dir);
+  cmd.AddValue ("fastLookup", "Answer global routing lookups from a longest prefix match trie", lpm_routing);
+  cmd.AddValue ("lpmBenchmark", "Time trie against linear route lookups after the routes are built", lpm_benchmark);
+  cmd.AddValue ("metricsSocket", "Serve live metrics in Prometheus text format on this Unix socket", metrics_socket);
+  cmd.AddValue ("metricsPort", "Serve live metrics over HTTP on this 127.0.0.1 port, 0 disables", metrics_port);
+  cmd.AddValue ("metricsInterval", "Simulated seconds between samples of the metrics gauges", metrics_interval);
+  cmd.AddValue ("memberMesh", "Link every pair of members of a cluster in p2p mode", member_mesh);
+  cmd.AddValue ("maxSteps", "Number of gym steps after which the episode is over, 0 disables", max_steps);
+  cmd.Parse (argc, argv);
+  reward_engine.Configure (reward_spec);
+  convergence_monitor.Configure (convergence_metrics, convergence_precision, batch_interval, warmup_batches, min_batches,
+                                 traffic_mode != "generator");
+  if (traffic_pattern != "cbr" && traffic_pattern != "poisson" && traffic_pattern != "onoff" && traffic_pattern != "bursty")
+    {
+      NS_FATAL_ERROR ("Unknown traffic pattern " << traffic_pattern);
+    }
+  NS_ABORT_MSG_IF (maxClusters < 2, "At least 2 clusters are needed, cluster 0 serves the others");
+  if (link_mode == "p2p")
+    {
+      // Every point-to-point link takes one of the 10.x.y.0/24 subnets of getBaseIP, numbered from 1
+      uint64_t subnets = (uint64_t) heads_per_cluster * maxClusters * (maxClusters - 1) / 2
+                         + (uint64_t) heads_per_cluster * maxClusters * nodesPerCluster;
+      if (member_mesh)
+        {
+          subnets += (uint64_t) maxClusters * nodesPerCluster * (nodesPerCluster - 1) / 2;
+        }
+      NS_ABORT_MSG_IF (subnets > 65535, subnets << " point-to-point subnets needed, at most 65535 fit in 10.0.0.0/8"
+                       << (member_mesh ? ", try --memberMesh=false" : ""));
+    }
+  NS_ABORT_MSG_IF (!(RunEnd () > 0), "The run must last longer than 0s, got " << RunEnd ());
+  NS_ABORT_MSG_IF (!(RunEnd () > SourceStart (maxClusters - 1)), "The run ends before the last cluster starts sending");
+  NS_ABORT_MSG_IF (GameOverTime () > RunEnd (), "simTime " << GameOverTime () << "s is past the end of the run at " << RunEnd () << "s");
+  return m_CSVfileName;
+}
+
+int main (int argc, char *argv[])
+{
+  RoutingExperiment experiment;
+  std::string CSVfileName = experiment.CommandSetup (argc,argv);
+
+  //blank out the last output file and write the column headers
+  std::ofstream out (CSVfileName.c_str ());
+  out << "SimulationSecond," <<
+  "ReceiveRate," <<
+  "PacketsReceived," <<
+  "NumberOfSinks," <<
+  "RoutingProtocol," <<
+  "TransmissionPower" <<
+  std::endl;
+  out.close ();
+
+  int nSinks = 3;
+  double txp = 7.5;
+
+  experiment.Run (nSinks, txp, CSVfileName);
+}
+
+
+std::string intToString(int num){
+    std::string retString = "";
+    do{
+        char digit = '0'+(num%10);
+        retString.push_back(digit);
+        num /= 10;
+    }while( num > 0 );
+    reverse(retString.begin(),retString.end());
+    return retString;
+}
+
+std::string getBaseIP(int clusterId){
+    // Past 255 subnets carry into the second octet
+    std::string baseAddress = "10." + intToString(clusterId / 256) + "." + intToString(clusterId % 256) + ".0";
+    return baseAddress;
+}
+
+// Selects the routing protocol of the stack, DSR is added by InstallDsr once the stack is in
+void RoutingExperiment::ConfigureRouting(InternetStackHelper &stack)
+{
+  AodvHelper aodv;
+  OlsrHelper olsr;
+  DsdvHelper dsdv;
+  Ipv4ListRoutingHelper list;
+
+  global_routing = false;
+  switch (m_protocol)
+    {
+    case 0:
+      m_protocolName = "GLOBAL";
+      global_routing = true;
+      return;
+    case 1:
+      list.Add (olsr, 100);
+      m_protocolName = "OLSR";
+      break;
+    case 2:
+      list.Add (aodv, 100);
+      m_protocolName = "AODV";
+      break;
+    case 3:
+      list.Add (dsdv, 100);
+      m_protocolName = "DSDV";
+      break;
+    case 4:
+      m_protocolName = "DSR";
+      return;
+    default:
+      NS_FATAL_ERROR ("No such protocol:" << m_protocol);
+    }
+  // Static routing stays in the list for the cluster multicast routes
+  Ipv4StaticRoutingHelper staticRouting;
+  list.Add (staticRouting, 0);
+  stack.SetRoutingHelper (list);
+}
+
+void RoutingExperiment::InstallDsr(void)
+{
+  if (m_protocol != 4) return;
+  NodeContainer allNodes;
+  for(int cluster = 0 ; cluster < maxClusters ; cluster ++){
+      allNodes.Add (clusters[cluster]);
+      allNodes.Add (clusterHeads[cluster]);
+  }
+  DsrHelper dsr;
+  DsrMainHelper dsrMain;
+  dsrMain.Install (dsr, allNodes);
+}
+
+// Appends this run to the comparison report, writing the header for a new file
+void RoutingExperiment::WriteRoutingReport(void)
+{
+  std::ifstream existing (m_reportFileName.c_str ());
+  bool newFile = !existing.good () || existing.peek () == std::ifstream::traits_type::eof ();
+  existing.close ();
+
+  double firstRtt = first_rtt_count > 0 ? first_rtt_sum / first_rtt_count : 0.0;
+  double laterRtt = later_rtt_count > 0 ? later_rtt_sum / later_rtt_count : 0.0;
+  uint64_t totalBytes = control_bytes + data_bytes;
+
+  // Per client: first request to first reply, less that client's own steady RTT
+  double discoverySum = 0.0;
+  uint32_t discoveryFlows = 0;
+  for (const auto &cluster : steerable_clients)
+    {
+      for (const auto &client : cluster)
+        {
+          double discovery;
+          if (client->GetRouteDiscovery (discovery))
+            {
+              discoverySum += discovery;
+              discoveryFlows ++;
+            }
+        }
+    }
+  double discovery = discoveryFlows > 0 ? discoverySum / discoveryFlows : 0.0;
+
+  std::ofstream out (m_reportFileName.c_str (), std::ios::app);
+  if (newFile)
+    {
+      out << "RoutingProtocol,LinkMode,Clusters,NodesPerCluster,"
+          << "ControlPackets,ControlBytes,DataPackets,DataBytes,OverheadRatio,"
+          << "FirstReplyRtt,MeanRtt,RouteDiscovery,DiscoveryFlows,Replies" << std::endl;
+    }
+  out << m_protocolName << "," << link_mode << "," << maxClusters << "," << nodesPerCluster << ","
+      << control_packets << "," << control_bytes << "," << data_packets << "," << data_bytes << ","
+      << (totalBytes > 0 ? (double) control_bytes / totalBytes : 0.0) << ","
+      << firstRtt << "," << laterRtt << "," << discovery << "," << discoveryFlows << ","
+      << first_rtt_count + later_rtt_count << std::endl;
+  out.close ();
+  NS_LOG_UNCOND (m_protocolName << ": " << control_packets << " control packets (" << control_bytes
+                 << " bytes), " << data_packets << " data packets (" << data_bytes << " bytes), route discovery "
+                 << discovery << "s over " << discoveryFlows << " flows, mean RTT " << laterRtt << "s");
+}
+
+/*
+ * Redundant cluster heads. With headsPerCluster k > 1 every cluster has k
+ * heads, head h of each cluster is meshed with head h of the others (one
+ * plane of head links per h) and every member has a link to each of its
+ * heads. Members pick the head for traffic leaving the cluster with a
+ * HeadSelector placed first in their list routing: the (member, destination)
+ * pair is hashed onto the heads, evenly for ecmp or by headWeights for
+ * weighted, so one flow always uses the same head and plane. Only
+ * destinations that address_cluster maps to another cluster are selected,
+ * everything else is left to the routing protocols below. Head 0 is the
+ * head every single head feature (clustering, caches, multicast) works on.
+ */
+std::vector < std::vector < std::vector<NetDeviceContainer> > > redundantHeadDevices;  // [cluster][node][head-1]
+
+struct HeadLoad
+{
+  uint64_t packets;
+  uint64_t bytes;
+};
+std::vector<HeadLoad> head_load;   // cluster*heads_per_cluster + head
+
+class HeadSelector : public Ipv4RoutingProtocol
+{
+public:
+  static TypeId GetTypeId (void);
+
+  void SetCluster (uint32_t cluster);
+  void AddHead (uint32_t interface, Ipv4Address gateway, double weight);
+
+  virtual Ptr<Ipv4Route> RouteOutput (Ptr<Packet> p, const Ipv4Header &header, Ptr<NetDevice> oif,
+                                      Socket::SocketErrno &sockerr);
+  virtual bool RouteInput (Ptr<const Packet> p, const Ipv4Header &header, Ptr<const NetDevice> idev,
+                           UnicastForwardCallback ucb, MulticastForwardCallback mcb,
+                           LocalDeliverCallback lcb, ErrorCallback ecb)
+  {
+    return false;
+  }
+  virtual void NotifyInterfaceUp (uint32_t interface) {}
+  virtual void NotifyInterfaceDown (uint32_t interface) {}
+  virtual void NotifyAddAddress (uint32_t interface, Ipv4InterfaceAddress address) {}
+  virtual void NotifyRemoveAddress (uint32_t interface, Ipv4InterfaceAddress address) {}
+  virtual void SetIpv4 (Ptr<Ipv4> ipv4);
+  virtual void PrintRoutingTable (Ptr<OutputStreamWrapper> stream, Time::Unit unit = Time::S) const;
+
+protected:
+  virtual void DoDispose (void);
+
+private:
+  bool OnLink (Ipv4Address destination) const;
+
+  Ptr<Ipv4> m_ipv4;
+  uint32_t m_cluster;
+  std::vector<uint32_t> m_interfaces;
+  std::vector<Ipv4Address> m_gateways;
+  std::vector<double> m_cumulative;   // running sum of the head weights
+};
+
+NS_OBJECT_ENSURE_REGISTERED (HeadSelector);
+
+TypeId
+HeadSelector::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("HeadSelector")
+    .SetParent<Ipv4RoutingProtocol> ()
+    .SetGroupName ("Internet")
+    .AddConstructor<HeadSelector> ()
+  ;
+  return tid;
+}
+
+void
+HeadSelector::DoDispose (void)
+{
+  m_ipv4 = 0;
+  Ipv4RoutingProtocol::DoDispose ();
+}
+
+void
+HeadSelector::SetIpv4 (Ptr<Ipv4> ipv4)
+{
+  m_ipv4 = ipv4;
+}
+
+void
+HeadSelector::SetCluster (uint32_t cluster)
+{
+  m_cluster = cluster;
+}
+
+void
+HeadSelector::AddHead (uint32_t interface, Ipv4Address gateway, double weight)
+{
+  m_interfaces.push_back (interface);
+  m_gateways.push_back (gateway);
+  m_cumulative.push_back ((m_cumulative.empty () ? 0.0 : m_cumulative.back ()) + weight);
+}
+
+void
+HeadSelector::PrintRoutingTable (Ptr<OutputStreamWrapper> stream, Time::Unit unit) const
+{
+  for (uint32_t head = 0; head < m_gateways.size (); head++)
+    {
+      *stream->GetStream () << "head " << head << " via " << m_gateways[head] << " interface " << m_interfaces[head] << std::endl;
+    }
+}
+
+// Destinations on a subnet of the node never go through a head
+bool
+HeadSelector::OnLink (Ipv4Address destination) const
+{
+  for (uint32_t interface = 0; interface < m_ipv4->GetNInterfaces (); interface++)
+    {
+      for (uint32_t index = 0; index < m_ipv4->GetNAddresses (interface); index++)
+        {
+          Ipv4InterfaceAddress address = m_ipv4->GetAddress (interface, index);
+          if (address.GetLocal ().CombineMask (address.GetMask ()) == destination.CombineMask (address.GetMask ()))
+            {
+              return true;
+            }
+        }
+    }
+  return false;
+}
+
+Ptr<Ipv4Route>
+HeadSelector::RouteOutput (Ptr<Packet> p, const Ipv4Header &header, Ptr<NetDevice> oif,
+                           Socket::SocketErrno &sockerr)
+{
+  Ipv4Address destination = header.GetDestination ();
+  if (m_gateways.empty () || destination.IsMulticast () || destination.IsBroadcast () || OnLink (destination))
+    {
+      sockerr = Socket::ERROR_NOROUTETOHOST;
+      return 0;
+    }
+  // Traffic staying inside the cluster, or to addresses of no cluster, never goes through a head
+  std::map<uint32_t, uint32_t>::const_iterator target = address_cluster.find (destination.Get ());
+  if (target == address_cluster.end () || target->second == m_cluster)
+    {
+      sockerr = Socket::ERROR_NOROUTETOHOST;
+      return 0;
+    }
+  // The same member and destination always hash onto the same head
+  uint32_t hash = (destination.Get () * 2654435761u) ^ (m_ipv4->GetObject<Node> ()->GetId () * 40503u);
+  hash ^= hash >> 16;
+  double point = (hash % 10000) / 10000.0 * m_cumulative.back ();
+  uint32_t head = 0;
+  while (head + 1 < m_cumulative.size () && point >= m_cumulative[head])
+    {
+      head ++;
+    }
+  // Links set down by reclustering are passed over for the next weighted head that is up
+  for (uint32_t tried = 0; !m_ipv4->IsUp (m_interfaces[head]); tried++)
+    {
+      if (tried + 1 >= m_interfaces.size ())
+        {
+          sockerr = Socket::ERROR_NOROUTETOHOST;
+          return 0;
+        }
+      do
+        {
+          head = (head + 1) % m_interfaces.size ();
+        }
+      while (m_cumulative[head] == (head == 0 ? 0.0 : m_cumulative[head - 1]));
+    }
+
+  Ptr<Ipv4Route> route = Create<Ipv4Route> ();
+  route->SetDestination (destination);
+  route->SetGateway (m_gateways[head]);
+  route->SetSource (m_ipv4->GetAddress (m_interfaces[head], 0).GetLocal ());
+  route->SetOutputDevice (m_ipv4->GetNetDevice (m_interfaces[head]));
+  sockerr = Socket::ERROR_NOTERROR;
+  return route;
+}
+
+void OnHeadForward(uint32_t slot, const Ipv4Header &header, Ptr<const Packet> packet, uint32_t interface)
+{
+  head_load[slot].packets ++;
+  head_load[slot].bytes += packet->GetSize ();
+}
+
+// Device connecting member node of cluster to one of its heads, member end first
+NetDeviceContainer MemberHeadLink(uint32_t cluster, uint32_t node, uint32_t head)
+{
+  return head == 0 ? intoClusterHeadDevices[cluster][node] : redundantHeadDevices[cluster][node][head - 1];
+}
+
+void InstallHeadSelectors(void)
+{
+  std::vector<double> weights (heads_per_cluster, 1.0);
+  if (head_balance == "weighted")
+    {
+      std::istringstream list (head_weights);
+      std::string weight;
+      uint32_t given = 0;
+      double total = 0.0;
+      while (std::getline (list, weight, ','))
+        {
+          NS_ABORT_MSG_IF (given >= heads_per_cluster, "More head weights than heads in " << head_weights);
+          char *end = 0;
+          weights[given] = std::strtod (weight.c_str (), &end);
+          NS_ABORT_MSG_IF (weight.empty () || *end != '\0', "Malformed head weight " << weight);
+          NS_ABORT_MSG_IF (!(weights[given] >= 0), "Negative head weight " << weight);
+          total += weights[given];
+          given ++;
+        }
+      NS_ABORT_MSG_IF (given != heads_per_cluster, "Weighted balance needs " << heads_per_cluster
+                       << " head weights, got " << given);
+      NS_ABORT_MSG_IF (!(total > 0), "Head weights are all zero");
+    }
+  else if (head_balance != "ecmp")
+    {
+      NS_FATAL_ERROR ("Unknown head balance " << head_balance);
+    }
+
+  for (int cluster = 0; cluster < maxClusters; cluster++)
+    {
+      for (int node = 0; node < nodesPerCluster; node++)
+        {
+          Ptr<Ipv4> ipv4 = clusters[cluster].Get (node)->GetObject<Ipv4> ();
+          Ptr<Ipv4ListRouting> list = DynamicCast<Ipv4ListRouting> (ipv4->GetRoutingProtocol ());
+          NS_ABORT_MSG_IF (!list, "Head selection needs list routing on node " << clusters[cluster].Get (node)->GetId ());
+          Ptr<HeadSelector> selector = CreateObject<HeadSelector> ();
+          selector->SetIpv4 (ipv4);
+          selector->SetCluster (cluster);
+          for (uint32_t head = 0; head < heads_per_cluster; head++)
+            {
+              NetDeviceContainer link = MemberHeadLink (cluster, node, head);
+              Ptr<Ipv4> headIpv4 = link.Get (1)->GetNode ()->GetObject<Ipv4> ();
+              Ipv4Address gateway = headIpv4->GetAddress (headIpv4->GetInterfaceForDevice (link.Get (1)), 0).GetLocal ();
+              selector->AddHead (ipv4->GetInterfaceForDevice (link.Get (0)), gateway, weights[head]);
+            }
+          list->AddRoutingProtocol (selector, 500);
+        }
+    }
+
+  HeadLoad empty = {0, 0};
+  head_load.assign (maxClusters * heads_per_cluster, empty);
+  for (int cluster = 0; cluster < maxClusters; cluster++)
+    {
+      for (uint32_t head = 0; head < heads_per_cluster; head++)
+        {
+          clusterHeads[cluster].Get (head)->GetObject<Ipv4L3Protocol> ()->TraceConnectWithoutContext (
+              "UnicastForward", MakeBoundCallback (&OnHeadForward, cluster * heads_per_cluster + head));
+        }
+    }
+}
+
+void ReportHeadLoad(void)
+{
+  for (int cluster = 0; cluster < maxClusters && !head_load.empty (); cluster++)
+    {
+      std::ostringstream loads;
+      uint64_t total = 0;
+      uint64_t busiest = 0;
+      for (uint32_t head = 0; head < heads_per_cluster; head++)
+        {
+          const HeadLoad &load = head_load[cluster * heads_per_cluster + head];
+          loads << (head > 0 ? " " : "") << load.packets;
+          total += load.packets;
+          busiest = std::max (busiest, load.packets);
+        }
+      if (total == 0) continue;
+      NS_LOG_UNCOND ("Cluster " << cluster << " head load (packets): " << loads.str ()
+                     << ", busiest carries " << 100.0 * busiest / total << "%");
+    }
+}
+
+/*
+ * Global route cache. The topology is fully determined by a handful of
+ * options, so the routes PopulateRoutingTables computes are saved per
+ * configuration hash in routeCache/routes-<hash>.bin:
+ *   "NS3RTC1\n", uint64 hash, uint32 node count, uint32 reserved,
+ *   per node: uint32 interfaces, uint32 routes, then routes as RouteRecord.
+ * A later run maps the file and bulk adds the routes to every node's
+ * Ipv4GlobalRouting instead of running the route computation. Nodes, links
+ * and stacks are still built, ns-3 objects cannot be restored from bytes;
+ * the interface counts are checked so a stale file is recomputed, not used.
+ */
+struct RouteRecord
+{
+  uint32_t destination;
+  uint32_t mask;
+  uint32_t gateway;     // 0.0.0.0 for on link routes
+  uint32_t interface;
+};
+
+
+uint64_t TopologyHash(void)
+{
+  std::ostringstream key;
+  key << link_mode << "/" << maxClusters << "/" << nodesPerCluster << "/" << heads_per_cluster
+      << "/" << head_aggregation << "/" << NodeList::GetNNodes ();
+  uint64_t hash = 14695981039346656037ull;   // FNV-1a
+  for (char c : key.str ())
+    {
+      hash = (hash ^ (uint8_t) c) * 1099511628211ull;
+    }
+  return hash;
+}
+
+std::string RouteCacheFile(uint64_t hash)
+{
+  std::ostringstream name;
+  name << route_cache_dir << "/routes-" << std::hex << hash << ".bin";
+  return name.str ();
+}
+
+Ptr<Ipv4GlobalRouting> GlobalRoutingOf(Ptr<Node> node)
+{
+  Ptr<Ipv4ListRouting> list = DynamicCast<Ipv4ListRouting> (node->GetObject<Ipv4> ()->GetRoutingProtocol ());
+  for (uint32_t i = 0; list && i < list->GetNRoutingProtocols (); i++)
+    {
+      int16_t priority;
+      Ptr<Ipv4GlobalRouting> global = DynamicCast<Ipv4GlobalRouting> (list->GetRoutingProtocol (i, priority));
+      if (global) return global;
+    }
+  return 0;
+}
+
+void SaveRouteCache(void)
+{
+  uint64_t hash = TopologyHash ();
+  std::ofstream out (RouteCacheFile (hash).c_str (), std::ios::binary);
+  if (!out.is_open ())
+    {
+      NS_LOG_UNCOND ("Cannot write route cache " << RouteCacheFile (hash));
+      return;
+    }
+  uint32_t nodes = NodeList::GetNNodes ();
+  uint32_t reserved = 0;
+  out.write ("NS3RTC1\n", 8);
+  out.write (reinterpret_cast<const char *> (&hash), sizeof (hash));
+  out.write (reinterpret_cast<const char *> (&nodes), sizeof (nodes));
+  out.write (reinterpret_cast<const char *> (&reserved), sizeof (reserved));
+  std::vector<RouteRecord> records;
+  for (uint32_t id = 0; id < nodes; id++)
+    {
+      Ptr<Node> node = NodeList::GetNode (id);
+      Ptr<Ipv4> ipv4 = node->GetObject<Ipv4> ();
+      Ptr<Ipv4GlobalRouting> global = ipv4 ? GlobalRoutingOf (node) : 0;
+      records.clear ();
+      for (uint32_t i = 0; global && i < global->GetNRoutes (); i++)
+        {
+          Ipv4RoutingTableEntry *entry = global->GetRoute (i);
+          RouteRecord record = {entry->GetDest ().Get (),
+                                entry->IsHost () ? 0xffffffffu : entry->GetDestNetworkMask ().Get (),
+                                entry->IsGateway () ? entry->GetGateway ().Get () : 0u,
+                                entry->GetInterface ()};
+          records.push_back (record);
+        }
+      uint32_t header[2] = {ipv4 ? ipv4->GetNInterfaces () : 0, (uint32_t) records.size ()};
+      out.write (reinterpret_cast<const char *> (header), sizeof (header));
+      out.write (reinterpret_cast<const char *> (records.data ()), records.size () * sizeof (RouteRecord));
+    }
+}
+
+// Returns false, leaving every table untouched, when there is no usable cache
+bool LoadRouteCache(void)
+{
+  uint64_t hash = TopologyHash ();
+  std::string fileName = RouteCacheFile (hash);
+  int fd = open (fileName.c_str (), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat info;
+  fstat (fd, &info);
+  size_t size = info.st_size;
+  void *data = size >= 24 ? mmap (0, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close (fd);
+  if (data == MAP_FAILED) return false;
+  madvise (data, size, MADV_SEQUENTIAL);
+  const uint8_t *bytes = static_cast<const uint8_t *> (data);
+
+  uint64_t storedHash;
+  uint32_t nodes;
+  std::memcpy (&storedHash, bytes + 8, sizeof (storedHash));
+  std::memcpy (&nodes, bytes + 16, sizeof (nodes));
+  bool usable = std::memcmp (bytes, "NS3RTC1\n", 8) == 0 && storedHash == hash && nodes == NodeList::GetNNodes ();
+
+  // Validate the whole file before touching any table
+  std::vector< std::pair<uint32_t, const RouteRecord *> > perNode;
+  size_t offset = 24;
+  for (uint32_t id = 0; usable && id < nodes; id++)
+    {
+      uint32_t header[2];
+      if (offset + sizeof (header) > size) { usable = false; break; }
+      std::memcpy (header, bytes + offset, sizeof (header));
+      offset += sizeof (header);
+      Ptr<Ipv4> ipv4 = NodeList::GetNode (id)->GetObject<Ipv4> ();
+      if ((ipv4 ? ipv4->GetNInterfaces () : 0) != header[0] || offset + header[1] * sizeof (RouteRecord) > size)
+        {
+          usable = false;
+          break;
+        }
+      perNode.push_back (std::make_pair (header[1], reinterpret_cast<const RouteRecord *> (bytes + offset)));
+      offset += header[1] * sizeof (RouteRecord);
+    }
+
+  for (uint32_t id = 0; usable && id < nodes; id++)
+    {
+      Ptr<Ipv4GlobalRouting> global = perNode[id].first > 0 ? GlobalRoutingOf (NodeList::GetNode (id)) : 0;
+      for (uint32_t i = 0; global && i < perNode[id].first; i++)
+        {
+          RouteRecord record;
+          std::memcpy (&record, perNode[id].second + i, sizeof (record));
+          Ipv4Address destination (record.destination);
+          if (record.mask == 0xffffffffu)
+            {
+              if (record.gateway != 0) global->AddHostRouteTo (destination, Ipv4Address (record.gateway), record.interface);
+              else global->AddHostRouteTo (destination, record.interface);
+            }
+          else
+            {
+              if (record.gateway != 0) global->AddNetworkRouteTo (destination, Ipv4Mask (record.mask), Ipv4Address (record.gateway), record.interface);
+              else global->AddNetworkRouteTo (destination, Ipv4Mask (record.mask), record.interface);
+            }
+        }
+    }
+  munmap (data, size);
+  return usable;
+}
+
+/*
+ * Longest prefix match over a node's global routes. Host routes, one per
+ * point to point interface in the network, go to a hash map, so the trie
+ * only holds the network routes and stays a few nodes deep and wide. The
+ * trie has 8 bit strides: each level is a 256 slot node, prefixes whose
+ * length is not a multiple of 8 are expanded over the slots they cover, and
+ * routes are pushed down to the leaves, so a slot holds either a route or a
+ * child (1KB a node) and the first route slot met is the longest match. A
+ * slot keeps the longest prefix, the first one on ties like the table order
+ * used by Ipv4GlobalRouting; the prefix lengths that decide this are only
+ * kept while building. A lookup is a hash probe and at most four array
+ * reads whatever the size of the table. The trie sits in the list routing above
+ * Ipv4GlobalRouting, which is left in place and only answers what the trie
+ * cannot (interface bound lookups). Ipv4GlobalRouting returns any matching
+ * network route rather than the longest, which is the same here since every
+ * link subnet is a /24.
+ */
+class LpmGlobalRouting : public Ipv4RoutingProtocol
+{
+public:
+  static TypeId GetTypeId (void);
+  LpmGlobalRouting ();
+
+  void Build (Ptr<Ipv4GlobalRouting> global);
+  int32_t Lookup (Ipv4Address destination) const;   // index into the routes, -1 when none
+  int32_t LinearLookup (Ipv4Address destination) const;
+  uint32_t GetNRoutes (void) const;
+
+  virtual Ptr<Ipv4Route> RouteOutput (Ptr<Packet> p, const Ipv4Header &header, Ptr<NetDevice> oif,
+                                      Socket::SocketErrno &sockerr);
+  virtual bool RouteInput (Ptr<const Packet> p, const Ipv4Header &header, Ptr<const NetDevice> idev,
+                           UnicastForwardCallback ucb, MulticastForwardCallback mcb,
+                           LocalDeliverCallback lcb, ErrorCallback ecb);
+  virtual void NotifyInterfaceUp (uint32_t interface) {}
+  virtual void NotifyInterfaceDown (uint32_t interface) {}
+  virtual void NotifyAddAddress (uint32_t interface, Ipv4InterfaceAddress address) {}
+  virtual void NotifyRemoveAddress (uint32_t interface, Ipv4InterfaceAddress address) {}
+  virtual void SetIpv4 (Ptr<Ipv4> ipv4);
+  virtual void PrintRoutingTable (Ptr<OutputStreamWrapper> stream, Time::Unit unit = Time::S) const;
+
+protected:
+  virtual void DoDispose (void);
+
+private:
+  // A slot is a route index (>= 0), no route (-1) or child node n (-2 - n)
+  struct TrieNode
+  {
+    int32_t slot[256];
+  };
+  uint32_t AddNode (int32_t fill, uint8_t length);
+  void Insert (uint32_t prefix, uint32_t length, int32_t route);
+  void Expand (uint32_t node, uint32_t slot, uint32_t length, int32_t route);
+  Ptr<Ipv4Route> MakeRoute (int32_t index, Ipv4Address destination) const;
+
+  Ptr<Ipv4> m_ipv4;
+  std::vector<TrieNode> m_nodes;     // m_nodes[0] is the root
+  std::vector<uint8_t> m_lengths;    // prefix length per slot, only while building
+  std::unordered_map<uint32_t, int32_t> m_hosts;
+  std::vector<RouteRecord> m_routes;
+  int32_t m_default;
+};
+
+NS_OBJECT_ENSURE_REGISTERED (LpmGlobalRouting);
+
+TypeId
+LpmGlobalRouting::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("LpmGlobalRouting")
+    .SetParent<Ipv4RoutingProtocol> ()
+    .SetGroupName ("Internet")
+    .AddConstructor<LpmGlobalRouting> ()
+  ;
+  return tid;
+}
+
+LpmGlobalRouting::LpmGlobalRouting ()
+  : m_default (-1)
+{
+}
+
+void
+LpmGlobalRouting::DoDispose (void)
+{
+  m_ipv4 = 0;
+  m_nodes.clear ();
+  m_hosts.clear ();
+  Ipv4RoutingProtocol::DoDispose ();
+}
+
+void
+LpmGlobalRouting::SetIpv4 (Ptr<Ipv4> ipv4)
+{
+  m_ipv4 = ipv4;
+}
+
+void
+LpmGlobalRouting::PrintRoutingTable (Ptr<OutputStreamWrapper> stream, Time::Unit unit) const
+{
+  *stream->GetStream () << "LpmGlobalRouting " << m_routes.size () << " routes, " << m_hosts.size ()
+                        << " hosts and " << m_nodes.size () << " trie nodes" << std::endl;
+}
+
+uint32_t
+LpmGlobalRouting::GetNRoutes (void) const
+{
+  return m_routes.size ();
+}
+
+uint32_t
+LpmGlobalRouting::AddNode (int32_t fill, uint8_t length)
+{
+  TrieNode node;
+  std::fill (node.slot, node.slot + 256, fill);
+  m_nodes.push_back (node);
+  m_lengths.insert (m_lengths.end (), 256, length);
+  return m_nodes.size () - 1;
+}
+
+void
+LpmGlobalRouting::Insert (uint32_t prefix, uint32_t length, int32_t route)
+{
+  if (length == 32)
+    {
+      m_hosts.emplace (prefix, route);
+      return;
+    }
+  if (length == 0)
+    {
+      if (m_default < 0) m_default = route;
+      return;
+    }
+  uint32_t node = 0;
+  uint32_t level = 0;
+  while (length > 8 * (level + 1))
+    {
+      uint8_t byte = (prefix >> (24 - 8 * level)) & 0xff;
+      int32_t value = m_nodes[node].slot[byte];
+      if (value >= -1)
+        {
+          // The route of the slot is pushed into every slot of the new child
+          uint32_t child = AddNode (value, m_lengths[node * 256 + byte]);
+          value = -2 - (int32_t) child;
+          m_nodes[node].slot[byte] = value;
+        }
+      node = -2 - value;
+      level ++;
+    }
+  uint32_t bits = length - 8 * level;
+  uint32_t first = ((prefix >> (24 - 8 * level)) & 0xff) & (0xff << (8 - bits)) & 0xff;
+  for (uint32_t slot = first; slot < first + (1u << (8 - bits)); slot++)
+    {
+      Expand (node, slot, length, route);
+    }
+}
+
+// Sets a slot to the route unless a longer prefix holds it, through every child below it
+void
+LpmGlobalRouting::Expand (uint32_t node, uint32_t slot, uint32_t length, int32_t route)
+{
+  int32_t value = m_nodes[node].slot[slot];
+  if (value <= -2)
+    {
+      for (uint32_t childSlot = 0; childSlot < 256; childSlot++)
+        {
+          Expand (-2 - value, childSlot, length, route);
+        }
+      return;
+    }
+  uint8_t &current = m_lengths[node * 256 + slot];
+  if (value == -1 || current < length)
+    {
+      m_nodes[node].slot[slot] = route;
+      current = length;
+    }
+}
+
+void
+LpmGlobalRouting::Build (Ptr<Ipv4GlobalRouting> global)
+{
+  m_nodes.clear ();
+  m_lengths.clear ();
+  m_hosts.clear ();
+  AddNode (-1, 0);
+  m_routes.clear ();
+  m_default = -1;
+  for (uint32_t i = 0; global && i < global->GetNRoutes (); i++)
+    {
+      Ipv4RoutingTableEntry *entry = global->GetRoute (i);
+      Ipv4Mask mask = entry->IsHost () ? Ipv4Mask::GetOnes () : entry->GetDestNetworkMask ();
+      RouteRecord record = {entry->GetDest ().Get (), mask.Get (),
+                            entry->IsGateway () ? entry->GetGateway ().Get () : 0u,
+                            entry->GetInterface ()};
+      m_routes.push_back (record);
+      Insert (record.destination & record.mask, mask.GetPrefixLength (), m_routes.size () - 1);
+    }
+  std::vector<uint8_t> ().swap (m_lengths);
+  std::vector<TrieNode> (m_nodes).swap (m_nodes);
+}
+
+int32_t
+LpmGlobalRouting::Lookup (Ipv4Address destination) const
+{
+  uint32_t address = destination.Get ();
+  std::unordered_map<uint32_t, int32_t>::const_iterator host = m_hosts.find (address);
+  if (host != m_hosts.end ())
+    {
+      return host->second;
+    }
+  uint32_t node = 0;
+  for (uint32_t level = 0; level < 4; level++)
+    {
+      int32_t value = m_nodes[node].slot[(address >> (24 - 8 * level)) & 0xff];
+      if (value >= 0) return value;
+      if (value == -1) break;
+      node = -2 - value;
+    }
+  return m_default;
+}
+
+// The scan Ipv4GlobalRouting does, kept for the micro benchmark
+int32_t
+LpmGlobalRouting::LinearLookup (Ipv4Address destination) const
+{
+  uint32_t address = destination.Get ();
+  int32_t best = -1;
+  uint32_t bestMask = 0;
+  for (uint32_t i = 0; i < m_routes.size (); i++)
+    {
+      const RouteRecord &record = m_routes[i];
+      if ((address & record.mask) == (record.destination & record.mask) && (best < 0 || record.mask > bestMask))
+        {
+          best = i;
+          bestMask = record.mask;
+        }
+    }
+  return best;
+}
+
+Ptr<Ipv4Route>
+LpmGlobalRouting::MakeRoute (int32_t index, Ipv4Address destination) const
+{
+  const RouteRecord &record = m_routes[index];
+  Ptr<Ipv4Route> route = Create<Ipv4Route> ();
+  route->SetDestination (destination);
+  route->SetGateway (record.gateway != 0 ? Ipv4Address (record.gateway) : Ipv4Address::GetZero ());
+  route->SetSource (m_ipv4->GetAddress (record.interface, 0).GetLocal ());
+  route->SetOutputDevice (m_ipv4->GetNetDevice (record.interface));
+  return route;
+}
+
+Ptr<Ipv4Route>
+LpmGlobalRouting::RouteOutput (Ptr<Packet> p, const Ipv4Header &header, Ptr<NetDevice> oif,
+                               Socket::SocketErrno &sockerr)
+{
+  Ipv4Address destination = header.GetDestination ();
+  int32_t index = destination.IsMulticast () ? -1 : Lookup (destination);
+  if (index < 0 || (oif && m_ipv4->GetNetDevice (m_routes[index].interface) != oif))
+    {
+      sockerr = Socket::ERROR_NOROUTETOHOST;
+      return 0;
+    }
+  sockerr = Socket::ERROR_NOTERROR;
+  return MakeRoute (index, destination);
+}
+
+bool
+LpmGlobalRouting::RouteInput (Ptr<const Packet> p, const Ipv4Header &header, Ptr<const NetDevice> idev,
+                              UnicastForwardCallback ucb, MulticastForwardCallback mcb,
+                              LocalDeliverCallback lcb, ErrorCallback ecb)
+{
+  Ipv4Address destination = header.GetDestination ();
+  if (destination.IsMulticast () || destination.IsBroadcast ())
+    {
+      return false;
+    }
+  if (!m_ipv4->IsForwarding (m_ipv4->GetInterfaceForDevice (idev)))
+    {
+      ecb (p, header, Socket::ERROR_NOROUTETOHOST);
+      return true;
+    }
+  int32_t index = Lookup (destination);
+  if (index < 0)
+    {
+      return false;
+    }
+  ucb (MakeRoute (index, destination), p, header);
+  return true;
 }
 
+std::vector < Ptr<LpmGlobalRouting> > lpm_tables;   // by node id, null where not installed
 
-std::string intToString(int num){
-    std::string retString = "";
-    do{
-        char digit = '0'+(num%10);
-        retString.push_back(digit);
-        num /= 10;
-    }while( num > 0 );
-    reverse(retString.begin(),retString.end());
-    return retString;
+// Builds the tries from the current global routes, installing them on first use
+void BuildLpmTables(void)
+{
+  if (!lpm_routing) return;
+  lpm_tables.resize (NodeList::GetNNodes ());
+  uint64_t routes = 0;
+  for (uint32_t id = 0; id < NodeList::GetNNodes (); id++)
+    {
+      Ptr<Node> node = NodeList::GetNode (id);
+      Ptr<Ipv4GlobalRouting> global = node->GetObject<Ipv4> () ? GlobalRoutingOf (node) : 0;
+      if (!global) continue;
+      if (!lpm_tables[id])
+        {
+          Ptr<Ipv4> ipv4 = node->GetObject<Ipv4> ();
+          Ptr<LpmGlobalRouting> lpm = CreateObject<LpmGlobalRouting> ();
+          lpm->SetIpv4 (ipv4);
+          DynamicCast<Ipv4ListRouting> (ipv4->GetRoutingProtocol ())->AddRoutingProtocol (lpm, 100);
+          lpm_tables[id] = lpm;
+        }
+      lpm_tables[id]->Build (global);
+      routes += lpm_tables[id]->GetNRoutes ();
+    }
+  NS_LOG_UNCOND ("LPM tries built over " << routes << " global routes");
 }
 
-std::string getBaseIP(int clusterId){
-    std::string baseAddress = "10.0." + intToString(clusterId) + ".0";
-    return baseAddress;
+// Seconds per lookup over rounds passes of the destinations, by trie or by linear scan;
+// linear results are subtracted, so the checksum stays 0 while both agree
+double TimeLpmLookups(Ptr<LpmGlobalRouting> table, const std::vector<Ipv4Address> &destinations,
+                      bool linear, uint32_t rounds, int64_t &checksum)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+  for (uint32_t round = 0; round < rounds; round++)
+    {
+      for (const auto &destination : destinations)
+        {
+          checksum += linear ? -table->LinearLookup (destination) : table->Lookup (destination);
+        }
+    }
+  double seconds = std::chrono::duration<double> (std::chrono::steady_clock::now () - start).count ();
+  return seconds / ((double) rounds * destinations.size ());
 }
 
-Ptr<Socket>
-RoutingExperiment::SetupPacketReceive(Ipv4Address addr, Ptr<Node> node, uint32_t checkPort)
+/*
+ * Times trie and linear lookups on the largest table for three kinds of
+ * destination: interface addresses, which the host map answers, addresses
+ * inside each link /24 that belong to no interface, which only the network
+ * routes in the trie match, and addresses outside 10.0.0.0/8 that no route
+ * but a default one matches. The host bits of the /24 addresses and the
+ * unrouted addresses come from a fixed multiplicative hash, so runs repeat.
+ */
+void BenchmarkLpm(void)
 {
-  TypeId tid = TypeId::LookupByName ("ns3::UdpSocketFactory");
-  Ptr<Socket> sink = Socket::CreateSocket (node, tid);
-  InetSocketAddress local = InetSocketAddress (addr, checkPort);
-  sink->Bind (local);
-  sink->SetRecvCallback (MakeCallback (&RoutingExperiment::ReceivePacket, this));
-
-  return sink;
+  Ptr<LpmGlobalRouting> largest;
+  for (const auto &table : lpm_tables)
+    {
+      if (table && (!largest || table->GetNRoutes () > largest->GetNRoutes ())) largest = table;
+    }
+  if (!largest) return;
+  std::vector<Ipv4Address> hosts;
+  std::vector<Ipv4Address> networks;
+  std::vector<Ipv4Address> unrouted;
+  for (uint32_t id = 0; id < NodeList::GetNNodes (); id++)
+    {
+      Ptr<Ipv4> ipv4 = NodeList::GetNode (id)->GetObject<Ipv4> ();
+      for (uint32_t interface = 1; ipv4 && interface < ipv4->GetNInterfaces (); interface++)
+        {
+          Ipv4InterfaceAddress address = ipv4->GetAddress (interface, 0);
+          hosts.push_back (address.GetLocal ());
+          uint32_t hash = ((uint32_t) hosts.size () * 2654435761u) >> 8;
+          // Point to point links only use .1 and .2 of their /24
+          uint32_t network = address.GetLocal ().CombineMask (address.GetMask ()).Get ();
+          networks.push_back (Ipv4Address (network | (3 + hash % 252)));
+          unrouted.push_back (Ipv4Address ((192u << 24) | (168u << 16) | (hash & 0xffff)));
+        }
+    }
+  const uint32_t rounds = 100;
+  const char *names[] = {"host map", "trie", "unrouted"};
+  const std::vector<Ipv4Address> *kinds[] = {&hosts, &networks, &unrouted};
+  int64_t checksum = 0;
+  for (uint32_t kind = 0; kind < 3; kind++)
+    {
+      const std::vector<Ipv4Address> &destinations = *kinds[kind];
+      if (destinations.empty ()) continue;
+      double trieSeconds = TimeLpmLookups (largest, destinations, false, rounds, checksum);
+      double linearSeconds = TimeLpmLookups (largest, destinations, true, rounds, checksum);
+      uint32_t mismatches = 0;
+      for (const auto &destination : destinations)
+        {
+          if (largest->Lookup (destination) != largest->LinearLookup (destination)) mismatches ++;
+        }
+      NS_LOG_UNCOND ("LPM benchmark over " << largest->GetNRoutes () << " routes, " << destinations.size ()
+                     << " " << names[kind] << " destinations: lookup " << trieSeconds * 1e9
+                     << " ns, linear " << linearSeconds * 1e9 << " ns per lookup, " << mismatches << " mismatches");
+    }
+  NS_LOG_UNCOND ("LPM benchmark checksum " << checksum);
 }
 
-void RoutingExperiment::Run(int nSinks, double txp, std::string CSVfileName)
+void RecomputeGlobalRoutes(void)
 {
-  m_protocolName = "protocol";
-  const int nodesPerCluster = 3;
-  const int maxClusters = 3;
-  Packet::EnablePrinting ();
-  m_txp = txp;
-  m_CSVfileName = CSVfileName;
-    
-  Time::SetResolution (Time::NS);
-  LogComponentEnable ("UdpEchoClientApplication", LOG_LEVEL_ALL);
-  LogComponentEnable ("UdpEchoServerApplication", LOG_LEVEL_ALL);
+  Ipv4GlobalRoutingHelper::RecomputeRoutingTables ();
+  BuildLpmTables ();
+}
 
-  // Create clusters and cluster heads
+// PopulateRoutingTables, or the cached routes of the same topology
+void PopulateGlobalRoutes(void)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+  bool cached = route_cache_dir != "" && LoadRouteCache ();
+  if (!cached)
+    {
+      Ipv4GlobalRoutingHelper::PopulateRoutingTables ();
+      if (route_cache_dir != "")
+        {
+          SaveRouteCache ();
+        }
+    }
+  double seconds = std::chrono::duration<double> (std::chrono::steady_clock::now () - start).count ();
+  NS_LOG_UNCOND ("Global routes " << (cached ? "loaded from cache" : "computed") << " in " << seconds << "s");
+  BuildLpmTables ();
+  if (lpm_benchmark)
+    {
+      BenchmarkLpm ();
+    }
+}
 
-  std::vector<NodeContainer> clusters, clusterHeads;
+void RoutingExperiment::CreateClusters(void)
+{
   for(int cluster = 0 ; cluster < maxClusters ; cluster ++){
       NodeContainer currentCluster;
       currentCluster.Create (nodesPerCluster);
       clusters.push_back(currentCluster);
 
       NodeContainer clusterHead;
-      clusterHead.Create (1);
+      clusterHead.Create (heads_per_cluster);
       clusterHeads.push_back(clusterHead);
   }
+}
+
+// What PointToPointHelper::Install does, with aggregating devices on both ends
+NetDeviceContainer InstallAggregatingLink(NodeContainer ends)
+{
+  NetDeviceContainer devices;
+  Ptr<PointToPointChannel> channel = CreateObject<PointToPointChannel> ();
+  channel->SetAttribute ("Delay", StringValue (head_link_delay));
+  ObjectFactory queueFactory;
+  queueFactory.SetTypeId ("ns3::DropTailQueue<Packet>");
+  queueFactory.Set ("MaxSize", StringValue (head_link_queue));
+  for (uint32_t end = 0; end < ends.GetN (); end++)
+    {
+      Ptr<AggregatingNetDevice> device = CreateObject<AggregatingNetDevice> ();
+      device->SetAttribute ("DataRate", StringValue (head_link_rate));
+      device->SetAttribute ("MaxFrameSize", UintegerValue (aggregation_size));
+      device->SetAttribute ("MaxDelay", TimeValue (Seconds (aggregation_delay)));
+      device->SetAddress (Mac48Address::Allocate ());
+      ends.Get (end)->AddDevice (device);
+      Ptr<Queue<Packet> > queue = queueFactory.Create<Queue<Packet> > ();
+      device->SetQueue (queue);
+      Ptr<NetDeviceQueueInterface> queueInterface = CreateObject<NetDeviceQueueInterface> ();
+      queueInterface->GetTxQueue (0)->ConnectQueueTraces (queue);
+      device->AggregateObject (queueInterface);
+      device->Attach (channel);
+      devices.Add (device);
+    }
+  return devices;
+}
+
+void ReportAggregation(void)
+{
+  uint64_t packets = 0;
+  uint64_t frames = 0;
+  uint64_t held = 0;
+  uint64_t dropped = 0;
+  double delaySum = 0.0;
+  double delayMax = 0.0;
+  for (const auto &link : clusterConnectionDevices)
+    {
+      for (uint32_t end = 0; end < link.GetN (); end++)
+        {
+          Ptr<AggregatingNetDevice> device = DynamicCast<AggregatingNetDevice> (link.Get (end));
+          if (!device) continue;
+          packets += device->GetPacketsAggregated ();
+          frames += device->GetFramesSent ();
+          held += device->GetPacketsHeld ();
+          dropped += device->GetPacketsDropped ();
+          delaySum += device->GetDelaySum ();
+          delayMax = std::max (delayMax, device->GetDelayMax ());
+        }
+    }
+  if (held == 0) return;
+  // Every packet folded into a frame spares its transmit and receive events and a 2 byte PPP
+  // header, but pays a 3 byte subframe header, so aggregation always adds framing bytes
+  uint64_t folded = packets - frames;
+  uint64_t bytesAdded = packets * AggregatingNetDevice::subframeHeader - folded * 2;
+  NS_LOG_UNCOND ("Aggregation: " << packets << " packets in " << frames << " frames, "
+                 << 2 * folded << " device events saved, " << bytesAdded << " framing bytes added, "
+                 << dropped << " held packets dropped with their frame, added delay mean "
+                 << delaySum / held << "s max " << delayMax << "s");
+}
 
+void RoutingExperiment::SetupPointToPointLinks(void)
+{
   // Set up in-cluster connections
 
   PointToPointHelper pointToPointInCluster;
   pointToPointInCluster.SetDeviceAttribute ("DataRate", StringValue ("5Mbps"));
   pointToPointInCluster.SetChannelAttribute ("Delay", StringValue ("2ms"));
 
-  std::vector <NetDeviceContainer> pairwiseConnectionDevices;
-
-  for(int cluster = 0 ; cluster < maxClusters ; cluster ++){
+  for(int cluster = 0 ; cluster < maxClusters && member_mesh ; cluster ++){
       for(int node_origin = 0 ; node_origin < (int)clusters[cluster].GetN() ; node_origin ++){
           for(int node_destination = node_origin+1 ; node_destination < (int)clusters[cluster].GetN() ; node_destination ++){
               // Create container with the two nodes that we want to connect pointToPoint 
@@ -374,28 +6102,35 @@ void RoutingExperiment::Run(int nSinks, double txp, std::string CSVfileName)
   // Set up inter-cluster connections
 
   PointToPointHelper pointToPointBetweenClusters;
-  pointToPointBetweenClusters.SetDeviceAttribute ("DataRate", StringValue ("5Mbps"));
-  pointToPointBetweenClusters.SetChannelAttribute ("Delay", StringValue ("2ms"));
+  pointToPointBetweenClusters.SetDeviceAttribute ("DataRate", StringValue (head_link_rate));
+  pointToPointBetweenClusters.SetChannelAttribute ("Delay", StringValue (head_link_delay));
+  pointToPointBetweenClusters.SetQueue ("ns3::DropTailQueue", "MaxSize", StringValue (head_link_queue));
 
-  std::vector <NetDeviceContainer> clusterConnectionDevices;
-
-  // Set up the connections between cluster heads
-  for(int cluster_origin = 0 ; cluster_origin < maxClusters ; cluster_origin ++){
+  // Set up the connections between cluster heads, one plane of links per head index
+  for(uint32_t head = 0 ; head < heads_per_cluster ; head ++){
+    for(int cluster_origin = 0 ; cluster_origin < maxClusters ; cluster_origin ++){
       for(int cluster_destination = cluster_origin+1 ; cluster_destination < maxClusters ; cluster_destination ++){
           // Create container with the two cluster heads that we want to connect pointToPoint 
           NodeContainer currentConnection;
-          currentConnection.Add ( clusterHeads[cluster_origin].Get(0) );
-          currentConnection.Add ( clusterHeads[cluster_destination].Get(0) );
+          currentConnection.Add ( clusterHeads[cluster_origin].Get(head) );
+          currentConnection.Add ( clusterHeads[cluster_destination].Get(head) );
 
           // Set up the Net Device for this connection
           NetDeviceContainer currentDevices;
-          currentDevices = pointToPointInCluster.Install (currentConnection);
+          if (head_aggregation)
+            {
+              currentDevices = InstallAggregatingLink (currentConnection);
+            }
+          else
+            {
+              currentDevices = pointToPointBetweenClusters.Install (currentConnection);
+            }
           clusterConnectionDevices.push_back(currentDevices);
       }
+    }
   }
 
   // Set up the connection of each node to its cluster head
-  std::vector < std::vector<NetDeviceContainer> > intoClusterHeadDevices;
   for(int cluster = 0 ; cluster < maxClusters ; cluster ++){
       std::vector<NetDeviceContainer> currentClusterHeadDevices;
       for(int node = 0 ; node < (int)clusters[cluster].GetN() ; node ++){
@@ -412,50 +6147,95 @@ void RoutingExperiment::Run(int nSinks, double txp, std::string CSVfileName)
       intoClusterHeadDevices.push_back(currentClusterHeadDevices);
   }
 
-    // Animation parameters
-
-  double leftmost_cluster = 10.0;
-  double cluster_x_delta = 30.0;
-  double cluster_head_y = 10.0;
-  double cluster_y = 60.0;
+  // Members also reach every redundant head directly
+  for(int cluster = 0 ; cluster < maxClusters ; cluster ++){
+      std::vector < std::vector<NetDeviceContainer> > currentRedundantDevices;
+      for(int node = 0 ; node < (int)clusters[cluster].GetN() ; node ++){
+          std::vector<NetDeviceContainer> nodeDevices;
+          for(uint32_t head = 1 ; head < heads_per_cluster ; head ++){
+              nodeDevices.push_back (pointToPointInCluster.Install (clusters[cluster].Get (node), clusterHeads[cluster].Get (head)));
+          }
+          currentRedundantDevices.push_back(nodeDevices);
+      }
+      redundantHeadDevices.push_back(currentRedundantDevices);
+  }
+}
 
-  // Movement
+void RoutingExperiment::SetupMobility(void)
+{
+  if (mobility_trace_file != "")
+    {
+      mobility_mode = "trace";
+      mobility_trace.Open (mobility_trace_file);
+    }
   for(int cluster = 0 ; cluster < maxClusters ; cluster ++){
+      // Larger clusters pack their rows closer so they start inside the bounds
+      int rows = (nodesPerCluster + 2) / 3;
+      double deltaY = rows > 1 ? std::min (30.0, 40.0 / (rows - 1)) : 30.0;
       MobilityHelper currentMobility;
       currentMobility.SetPositionAllocator ("ns3::GridPositionAllocator",
                                               "MinX", DoubleValue (leftmost_cluster + cluster*cluster_x_delta),
                                               "MinY", DoubleValue (cluster_y),
                                               "DeltaX", DoubleValue (10.0),
-                                              "DeltaY", DoubleValue (30.0),
+                                              "DeltaY", DoubleValue (deltaY),
                                               "GridWidth", UintegerValue (3),
                                               "LayoutType", StringValue ("RowFirst"));
 
-      currentMobility.SetMobilityModel ("ns3::RandomWalk2dMobilityModel",
-                                  "Bounds", RectangleValue (
-                                      Rectangle ( leftmost_cluster + cluster*cluster_x_delta,
-                                                  leftmost_cluster + (cluster+1.0)*cluster_x_delta,
-                                                  -100,
-                                                  100 )));
-      currentMobility.Install (clusters[cluster]);
-  }
-  
+      Rectangle bounds ( leftmost_cluster + cluster*cluster_x_delta,
+                         leftmost_cluster + (cluster+1.0)*cluster_x_delta,
+                         -100,
+                         100 );
+      if (mobility_mode == "trace")
+        {
+          // Trace node i is the i-th member, counting cluster by cluster
+          for(int node = 0 ; node < (int)clusters[cluster].GetN() ; node ++){
+              Ptr<TraceReplayMobilityModel> replay = CreateObject<TraceReplayMobilityModel> ();
+              clusters[cluster].Get (node)->AggregateObject (replay);
+              replay->Attach (&mobility_trace, cluster * nodesPerCluster + node);
+          }
+        }
+      else if (mobility_mode == "batched")
+        {
+          currentMobility.SetMobilityModel ("BatchedMobilityModel");
+          currentMobility.Install (clusters[cluster]);
+          for(int node = 0 ; node < (int)clusters[cluster].GetN() ; node ++){
+              clusters[cluster].Get (node)->GetObject<BatchedMobilityModel> ()->Attach (&batched_mobility, bounds);
+          }
+        }
+      else
+        {
+          currentMobility.SetMobilityModel ("ns3::RandomWalk2dMobilityModel",
+                                      "Bounds", RectangleValue (bounds));
+          currentMobility.Install (clusters[cluster]);
+        }
 
-  AnimationInterface anim("manetSimulator.xml");
-  for(int cluster = 0 ; cluster < maxClusters ; cluster ++){
-      anim.SetConstantPosition(clusterHeads[cluster].Get(0),
-          leftmost_cluster+cluster*30.0, (cluster%2 == 0) ? cluster_head_y : cluster_head_y*1.5 );
+      // Cluster heads stay where the animation draws them
+      MobilityHelper headMobility;
+      headMobility.SetMobilityModel ("ns3::ConstantPositionMobilityModel");
+      headMobility.Install (clusterHeads[cluster]);
+      for(uint32_t head = 0 ; head < heads_per_cluster ; head ++){
+          clusterHeads[cluster].Get (head)->GetObject<MobilityModel> ()->SetPosition (
+              Vector (leftmost_cluster+cluster*30.0+head*8.0, (cluster%2 == 0) ? cluster_head_y : cluster_head_y*1.5, 0.0));
+      }
   }
+  if (mobility_mode == "batched")
+    {
+      batched_mobility.Start (Seconds (mobility_tick), Seconds (1.0), 2.0, 4.0);
+    }
+}
 
+void RoutingExperiment::AssignPointToPointAddresses(void)
+{
   // Install InternetStackHelper in each node
 
   InternetStackHelper stack;
+  ConfigureRouting (stack);
   for(int cluster = 0 ; cluster < maxClusters ; cluster ++){
       stack.Install (clusters[cluster]);
   }
 
   // Set up the Ipv4AddressHelper for each pairwise subnet
 
-  std::vector <Ipv4InterfaceContainer> pairwiseConnectionInterfaces;
   Ipv4AddressHelper address;
   int currentSubnet = 1;
   std::string mask = "255.255.255.0";
@@ -474,10 +6254,36 @@ void RoutingExperiment::Run(int nSinks, double txp, std::string CSVfileName)
   for(int cluster = 0 ; cluster < maxClusters ; cluster ++){
       stack.Install (clusterHeads[cluster]);
   }
+  InstallDsr ();
+
+  // Queue discs go in before addressing, which would otherwise install its default one
+  if (head_queue_disc != "default")
+    {
+      TrafficControlHelper trafficControl;
+      if (head_queue_disc == "fqcodel")
+        {
+          trafficControl.SetRootQueueDisc ("ns3::FqCoDelQueueDisc");
+        }
+      else if (head_queue_disc == "pie")
+        {
+          trafficControl.SetRootQueueDisc ("ns3::PieQueueDisc");
+        }
+      else if (head_queue_disc == "pfifo")
+        {
+          trafficControl.SetRootQueueDisc ("ns3::PfifoFastQueueDisc");
+        }
+      else
+        {
+          NS_FATAL_ERROR ("Unknown head queue disc " << head_queue_disc);
+        }
+      for (const auto &link : clusterConnectionDevices)
+        {
+          trafficControl.Install (link);
+        }
+    }
 
   // Set up the Ipv4AddressHelper for each inter-cluster subnet
 
-  std::vector <Ipv4InterfaceContainer> connectionInterfaces;
   for(int device = 0 ; device < (int)clusterConnectionDevices.size() ; device ++){
       std::string baseIP = getBaseIP(currentSubnet);
       address.SetBase (baseIP.c_str(), mask.c_str());
@@ -489,7 +6295,6 @@ void RoutingExperiment::Run(int nSinks, double txp, std::string CSVfileName)
   }
 
   // Set up and store the Ipv4AddressHelper for each subnet between nodes and their cluster head
-  std::vector < std::vector <Ipv4InterfaceContainer> > intoClusterHeadInterfaces;
   for(int cluster = 0 ; cluster < (int)intoClusterHeadDevices.size() ; cluster ++){
       std::vector <Ipv4InterfaceContainer> currentClusterHeadInterfaces;
       for(int device = 0 ; device < (int)intoClusterHeadDevices[cluster].size() ; device ++){
@@ -504,75 +6309,581 @@ void RoutingExperiment::Run(int nSinks, double txp, std::string CSVfileName)
       intoClusterHeadInterfaces.push_back(currentClusterHeadInterfaces);
   }
 
+  for(int cluster = 0 ; cluster < (int)redundantHeadDevices.size() ; cluster ++){
+      for(int node = 0 ; node < (int)redundantHeadDevices[cluster].size() ; node ++){
+          for(const auto &devices : redundantHeadDevices[cluster][node]){
+              std::string baseIP = getBaseIP(currentSubnet);
+              address.SetBase (baseIP.c_str(), mask.c_str());
+              currentSubnet ++;
+              address.Assign (devices);
+          }
+      }
+  }
+
+  for(int server = 0 ; server < nodesPerCluster ; server ++){
+      server_addresses.push_back (intoClusterHeadInterfaces[0][server].GetAddress (0));
+  }
+  next_subnet = currentSubnet;
+}
+
+// Every member and head shares one ad hoc medium, global routing falls back to AODV there
+void RoutingExperiment::SetupWirelessLinks(void)
+{
+  Ptr<GridWirelessChannel> channel = CreateObject<GridWirelessChannel> ();
+  channel->SetAttribute ("Range", DoubleValue (wireless_range));
+  wireless_channel = channel;
+
+  NodeContainer allNodes;
+  for(int cluster = 0 ; cluster < maxClusters ; cluster ++){
+      allNodes.Add (clusters[cluster]);
+      allNodes.Add (clusterHeads[cluster]);
+  }
+
+  SimpleNetDeviceHelper wireless;
+  wireless.SetDeviceAttribute ("DataRate", DataRateValue (DataRate ("2Mbps")));
+  NetDeviceContainer devices = wireless.Install (allNodes, channel);
+
+  if (m_protocol == 0)
+    {
+      m_protocol = 2;
+    }
+  InternetStackHelper stack;
+  ConfigureRouting (stack);
+  stack.Install (allNodes);
+  InstallDsr ();
+
+  Ipv4AddressHelper address;
+  address.SetBase ("10.1.0.0", "255.255.0.0");
+  Ipv4InterfaceContainer interfaces = address.Assign (devices);
+
+  // Cluster 0 members come first in allNodes
+  for(int server = 0 ; server < nodesPerCluster ; server ++){
+      server_addresses.push_back (interfaces.GetAddress (server));
+  }
+  channel->StartRefresh ();
+}
+
+// Maps every member address to its home cluster and opens the cluster matrix, for both traffic modes
+void SetupClusterMatrix(void)
+{
+  cluster_matrix.Resize (maxClusters);
+  for (int cluster = 0; cluster < maxClusters; cluster++)
+    {
+      for (uint32_t node = 0; node < clusters[cluster].GetN (); node++)
+        {
+          Ptr<Ipv4> memberIpv4 = clusters[cluster].Get (node)->GetObject<Ipv4> ();
+          for (uint32_t interface = 1; interface < memberIpv4->GetNInterfaces (); interface++)
+            {
+              address_cluster[memberIpv4->GetAddress (interface, 0).GetLocal ().Get ()] = cluster;
+            }
+        }
+    }
+  if (cluster_matrix_file != "")
+    {
+      cluster_matrix.Open (cluster_matrix_file, cluster_matrix_interval);
+    }
+}
+
+void ReportClusterMatrix(void)
+{
+  for (int src = 0; src < maxClusters; src++)
+    {
+      for (int dst = 0; dst < maxClusters; dst++)
+        {
+          if (cluster_matrix.GetPercentile (src, dst, 0.99) == 0.0) continue;
+          NS_LOG_UNCOND ("Cluster " << src << " -> " << dst << ": p99 " << cluster_matrix.GetPercentile (src, dst, 0.99)
+                         << "s, loss " << cluster_matrix.GetLoss (src, dst));
+        }
+    }
+  cluster_matrix.WriteTotal ();
+}
+
+void RoutingExperiment::SetupApplications(void)
+{
   // Program calls
 
-  UdpEchoServerHelper echoServer (9);
+  SetupClusterMatrix ();
+
+  ObjectFactory echoServerFactory;
+  echoServerFactory.SetTypeId ("TimestampedEchoServer");
+  echoServerFactory.Set ("Port", UintegerValue (echoPort));
+  echoServerFactory.Set ("ProcessingTime", TimeValue (Seconds (echo_processing_time)));
 
   for( int mainClusterNode = 0 ; mainClusterNode < nodesPerCluster ; mainClusterNode ++ ){
-      ApplicationContainer serverApps = echoServer.Install (clusters[0].Get (mainClusterNode));
-      serverApps.Start (Seconds (0.0));
-      serverApps.Stop (Seconds (30.0));
+      Ptr<TimestampedEchoServer> server = echoServerFactory.Create<TimestampedEchoServer> ();
+      clusters[0].Get (mainClusterNode)->AddApplication (server);
+      server->SetStartTime (Seconds (0.0));
+      server->SetStopTime (Seconds (RunEnd ()));
   }
 
-  std::vector <UdpEchoClientHelper> echoClients;
-  for(int clientApp = 0 ; clientApp < nodesPerCluster ; clientApp ++){
-      UdpEchoClientHelper echoClient (intoClusterHeadInterfaces[0][clientApp].GetAddress (0), 9);
-      echoClient.SetAttribute ("MaxPackets", UintegerValue (15));
-      echoClient.SetAttribute ("Interval", TimeValue (Seconds (1.0)));
-      echoClient.SetAttribute ("PacketSize", UintegerValue (1024));
-      echoClients.push_back(echoClient);
+  // Echo clients can be retargeted by the gym actions, start on server (node % nodesPerCluster)
+  ObjectFactory echoClientFactory;
+  echoClientFactory.SetTypeId ("SteerableEchoClient");
+  echoClientFactory.Set ("MaxPackets", UintegerValue ((uint32_t) std::max (SourceStop (0) - SourceStart (0), 1.0)));
+  echoClientFactory.Set ("Interval", TimeValue (Seconds (1.0)));
+  echoClientFactory.Set ("PacketSize", UintegerValue (1024));
+  echoClientFactory.Set ("RemotePort", UintegerValue (echoPort));
+
+  steerable_clients.assign (maxClusters, std::vector < Ptr<SteerableEchoClient> > ());
+
+  if (traffic_mode == "generator")
+    {
+      SetupTrafficGenerators ();
+      return;
+    }
+
+  // Set up calls from cluster 1 and 2
+  for(int cluster = 1 ; cluster < maxClusters ; cluster ++){
+      for(int node = 0 ; node < nodesPerCluster ; node ++){
+          echoClientFactory.Set ("RemoteAddress", AddressValue (server_addresses[(node)%nodesPerCluster]));
+          Ptr<SteerableEchoClient> client = echoClientFactory.Create<SteerableEchoClient> ();
+          clusters[cluster].Get (node)->AddApplication (client);
+          client->SetStartTime (Seconds (SourceStart (cluster)));
+          client->SetStopTime (Seconds (SourceStop (cluster)));
+          steerable_clients[cluster].push_back (client);
+      }
   }
+}
+
+// Address a member is reached at, its first interface after the loopback
+Ipv4Address MemberAddress (uint32_t cluster, uint32_t node)
+{
+  Ptr<Ipv4> ipv4 = clusters[cluster].Get (node)->GetObject<Ipv4> ();
+  return ipv4->GetAddress (1, 0).GetLocal ();
+}
+
+/*
+ * Expands a traffic matrix spec into member to member flows. The weight of a
+ * flow scales --trafficRate.
+ *   fanin          clusters 1.. send to server node%nodesPerCluster of cluster 0
+ *   hotspot[:c]    every member outside cluster c sends to member node%nodesPerCluster of c
+ *   all-to-all     every member sends to every member of the other clusters, split evenly
+ *   gravity        like all-to-all, split in proportion to 1/d^2 between cluster heads
+ *   csv:file       rows of srcCluster,srcNode,dstCluster,dstNode,weight
+ */
+std::vector<TrafficFlow> BuildTrafficMatrix (const std::string &spec)
+{
+  std::vector<TrafficFlow> flows;
+  uint32_t members = nodesPerCluster;
+  uint32_t clusterCount = maxClusters;
+  std::string kind = spec.substr (0, spec.find (':'));
+  std::string argument = (spec.find (':') == std::string::npos) ? "" : spec.substr (spec.find (':') + 1);
+
+  if (kind == "fanin")
+    {
+      for (uint32_t cluster = 1; cluster < clusterCount; cluster++)
+        {
+          for (uint32_t node = 0; node < members; node++)
+            {
+              flows.push_back ({cluster, node, 0, node % members, 1.0});
+            }
+        }
+    }
+  else if (kind == "hotspot")
+    {
+      uint32_t hotspot = argument.empty () ? 0 : std::stoul (argument);
+      NS_ABORT_MSG_IF (hotspot >= clusterCount, "Hotspot cluster " << hotspot << " does not exist");
+      for (uint32_t cluster = 0; cluster < clusterCount; cluster++)
+        {
+          if (cluster == hotspot) continue;
+          for (uint32_t node = 0; node < members; node++)
+            {
+              flows.push_back ({cluster, node, hotspot, node % members, 1.0});
+            }
+        }
+    }
+  else if (kind == "all-to-all" || kind == "gravity")
+    {
+      std::vector<Vector> heads;
+      for (uint32_t cluster = 0; cluster < clusterCount; cluster++)
+        {
+          heads.push_back (clusterHeads[cluster].Get (0)->GetObject<MobilityModel> ()->GetPosition ());
+        }
+      for (uint32_t src = 0; src < clusterCount; src++)
+        {
+          // Per source cluster weights, normalised so every member offers --trafficRate
+          std::vector<double> attraction (clusterCount, 0.0);
+          double total = 0.0;
+          for (uint32_t dst = 0; dst < clusterCount; dst++)
+            {
+              if (dst == src) continue;
+              double distance = std::max (CalculateDistance (heads[src], heads[dst]), 1.0);
+              attraction[dst] = (kind == "gravity") ? 1.0 / (distance * distance) : 1.0;
+              total += attraction[dst];
+            }
+          for (uint32_t dst = 0; dst < clusterCount && total > 0; dst++)
+            {
+              if (dst == src) continue;
+              for (uint32_t node = 0; node < members; node++)
+                {
+                  for (uint32_t peer = 0; peer < members; peer++)
+                    {
+                      flows.push_back ({src, node, dst, peer, attraction[dst] / total / members});
+                    }
+                }
+            }
+        }
+    }
+  else if (kind == "csv")
+    {
+      std::ifstream in (argument.c_str ());
+      NS_ABORT_MSG_IF (!in.is_open (), "Cannot open traffic matrix " << argument);
+      std::string line;
+      while (std::getline (in, line))
+        {
+          if (line.empty () || line[0] == '#') continue;
+          std::replace (line.begin (), line.end (), ',', ' ');
+          std::istringstream row (line);
+          TrafficFlow flow;
+          if (!(row >> flow.srcCluster >> flow.srcNode >> flow.dstCluster >> flow.dstNode >> flow.weight))
+            {
+              continue;   // header or malformed row
+            }
+          NS_ABORT_MSG_IF (flow.srcCluster >= clusterCount || flow.dstCluster >= clusterCount
+                           || flow.srcNode >= members || flow.dstNode >= members,
+                           "Traffic matrix row out of range: " << line);
+          flows.push_back (flow);
+        }
+    }
+  else
+    {
+      NS_FATAL_ERROR ("Unknown traffic matrix " << spec);
+    }
+  return flows;
+}
 
-  // Set up calls from cluster 1
-  for(int node = 0 ; node < nodesPerCluster ; node ++){
-      UdpEchoClientHelper echoClient = echoClients[(node)%nodesPerCluster];
-      ApplicationContainer clientApps = echoClient.Install (clusters[1].Get (node));
-      clientApps.Start (Seconds (5.0));
-      clientApps.Stop (Seconds (20.0));
+// Generators replace the echo clients, flow sinks on the members absorb their traffic
+void RoutingExperiment::SetupTrafficGenerators(void)
+{
+  ObjectFactory sinkFactory;
+  sinkFactory.SetTypeId ("FlowSink");
+  sinkFactory.Set ("Port", UintegerValue (generatorPort));
+  sinkFactory.Set ("MaxFlows", UintegerValue (nodesPerCluster * maxClusters));
+  // Any member may be a destination of the matrix, an idle sink costs nothing
+  for(int cluster = 0 ; cluster < maxClusters ; cluster ++){
+      for(int node = 0 ; node < nodesPerCluster ; node ++){
+          sinkFactory.Set ("Cluster", UintegerValue (cluster));
+          Ptr<FlowSink> sink = sinkFactory.Create<FlowSink> ();
+          clusters[cluster].Get (node)->AddApplication (sink);
+          sink->SetStartTime (Seconds (0.0));
+          sink->SetStopTime (Seconds (RunEnd ()));
+          flow_sinks.push_back (sink);
+      }
   }
 
-  // Set up calls from cluster 2
-  for(int node = 0 ; node < nodesPerCluster ; node ++){
-      UdpEchoClientHelper echoClient = echoClients[(node)%nodesPerCluster];
-      ApplicationContainer clientApps = echoClient.Install (clusters[2].Get (node));
-      clientApps.Start (Seconds (10.0));
-      clientApps.Stop (Seconds (25.0));
+  if (sink_dump_file != "")
+    {
+      sink_dump.open (sink_dump_file.c_str ());
+      NS_ABORT_MSG_IF (!sink_dump.is_open (), "Cannot open sink dump file " << sink_dump_file);
+      sink_dump << "Time,Node,Source,Port,Packets,Bytes,Lost,MeanDelay";
+      for (uint32_t b = 0; b < FlowSink::delayBuckets; b++)
+        {
+          sink_dump << ",Le" << FlowSink::GetBucketDelay (b);
+        }
+      sink_dump << std::endl;
+      Simulator::Schedule (Seconds (sink_dump_interval), &DumpFlowSinks);
+    }
+  ObjectFactory generatorFactory;
+  generatorFactory.SetTypeId ("TrafficGenerator");
+  generatorFactory.Set ("Pattern", StringValue (traffic_pattern));
+  generatorFactory.Set ("PacketSize", UintegerValue (traffic_packet_size));
+  generatorFactory.Set ("MaxPacketSize", UintegerValue (traffic_max_packet_size));
+  generatorFactory.Set ("RemotePort", UintegerValue (generatorPort));
+
+  double rate = DataRate (traffic_rate).GetBitRate ();
+  for (const TrafficFlow &flow : BuildTrafficMatrix (traffic_matrix))
+    {
+      uint64_t flowRate = (uint64_t) (rate * flow.weight);
+      if (flowRate == 0) continue;
+      generatorFactory.Set ("RemoteAddress", AddressValue (MemberAddress (flow.dstCluster, flow.dstNode)));
+      generatorFactory.Set ("DataRate", DataRateValue (DataRate (flowRate)));
+      Ptr<TrafficGenerator> generator = generatorFactory.Create<TrafficGenerator> ();
+      clusters[flow.srcCluster].Get (flow.srcNode)->AddApplication (generator);
+      generator->SetStartTime (Seconds (SourceStart (flow.srcCluster)));
+      generator->SetStopTime (Seconds (SourceStop (flow.srcCluster)));
+      traffic_generators.push_back (generator);
+    }
+}
+
+/*
+ * Cluster multicast. Every cluster k has the group 225.1.k.1. Static
+ * multicast routes follow the home layout of SetupPointToPointLinks: the
+ * source member sends one copy to its head, its head forwards one copy over
+ * the head link toward each destination cluster, and the destination head
+ * replicates it onto its member links. Unicast fan-out would have carried
+ * one copy per member over the first two of those hops. Members moved by
+ * reclustering keep receiving through their home head only.
+ */
+const uint16_t multicastPort = 6000;
+std::vector < Ptr<TrafficGenerator> > multicast_sources;
+
+Ipv4Address ClusterGroup(uint32_t cluster)
+{
+  return Ipv4Address (0xE1010001 + (cluster << 8));
+}
+
+// Index of the head link between two clusters in clusterConnectionDevices, and which end a sits at
+uint32_t HeadLinkIndex(uint32_t a, uint32_t b, uint32_t &endOfA)
+{
+  uint32_t low = std::min (a, b);
+  uint32_t high = std::max (a, b);
+  endOfA = (a == low) ? 0 : 1;
+  uint32_t index = 0;
+  for (uint32_t origin = 0; origin < low; origin++)
+    {
+      index += maxClusters - origin - 1;
+    }
+  return index + (high - low - 1);
+}
+
+// Member 0 of cluster 0 disseminates to every other cluster through its group
+void SetupClusterMulticast(void)
+{
+  NS_ABORT_MSG_IF (link_mode != "p2p", "Cluster multicast routes are derived from the point to point layout");
+  Ipv4StaticRoutingHelper staticRouting;
+  Ptr<Node> source = clusters[0].Get (0);
+  Ipv4Address sourceAddress = MemberAddress (0, 0);
+  staticRouting.SetDefaultMulticastRoute (source, intoClusterHeadDevices[0][0].Get (0));
+
+  ObjectFactory sinkFactory;
+  sinkFactory.SetTypeId ("FlowSink");
+  sinkFactory.Set ("Port", UintegerValue (multicastPort));
+  ObjectFactory generatorFactory;
+  generatorFactory.SetTypeId ("TrafficGenerator");
+  generatorFactory.Set ("RemotePort", UintegerValue (multicastPort));
+  generatorFactory.Set ("DataRate", DataRateValue (DataRate (multicast_rate)));
+  generatorFactory.Set ("PacketSize", UintegerValue (512));
+
+  for (int cluster = 1; cluster < maxClusters; cluster++)
+    {
+      Ipv4Address group = ClusterGroup (cluster);
+      uint32_t sourceEnd;
+      uint32_t link = HeadLinkIndex (0, cluster, sourceEnd);
+      staticRouting.AddMulticastRoute (clusterHeads[0].Get (0), sourceAddress, group,
+                                       intoClusterHeadDevices[0][0].Get (1),
+                                       NetDeviceContainer (clusterConnectionDevices[link].Get (sourceEnd)));
+      NetDeviceContainer memberLinks;
+      for (int node = 0; node < nodesPerCluster; node++)
+        {
+          memberLinks.Add (intoClusterHeadDevices[cluster][node].Get (1));
+          Ptr<FlowSink> sink = sinkFactory.Create<FlowSink> ();
+          clusters[cluster].Get (node)->AddApplication (sink);
+          sink->SetStartTime (Seconds (0.0));
+          sink->SetStopTime (Seconds (RunEnd ()));
+          flow_sinks.push_back (sink);
+        }
+      staticRouting.AddMulticastRoute (clusterHeads[cluster].Get (0), sourceAddress, group,
+                                       clusterConnectionDevices[link].Get (1 - sourceEnd), memberLinks);
+
+      generatorFactory.Set ("RemoteAddress", AddressValue (group));
+      Ptr<TrafficGenerator> generator = generatorFactory.Create<TrafficGenerator> ();
+      source->AddApplication (generator);
+      generator->SetStartTime (Seconds (std::min (1.0, RunEnd () / 4.0)));
+      generator->SetStopTime (Seconds (RunEnd () - std::min (1.0, RunEnd () / 4.0)));
+      multicast_sources.push_back (generator);
+    }
+}
+
+void ReportClusterMulticast(void)
+{
+  uint64_t packets = 0;
+  uint64_t bytes = 0;
+  for (const auto &generator : multicast_sources)
+    {
+      packets += generator->GetPacketsSent ();
+      bytes += generator->GetBytesSent ();
+    }
+  if (packets == 0) return;
+  // Source link and head link each carried one copy instead of nodesPerCluster
+  uint64_t copiesSaved = 2 * (nodesPerCluster - 1);
+  NS_LOG_UNCOND ("Cluster multicast: " << packets << " packets sent, " << packets * copiesSaved
+                 << " packets and " << bytes * copiesSaved << " bytes saved versus unicast fan-out");
+}
+
+void RoutingExperiment::ReportTrafficGenerators(void)
+{
+  if (traffic_generators.empty ()) return;
+  uint64_t packets = 0;
+  double rate = 0.0;
+  for (const auto &generator : traffic_generators)
+    {
+      packets += generator->GetPacketsSent ();
+      rate += generator->GetAchievedRate ();
+    }
+  NS_LOG_UNCOND ("Traffic generators: " << packets << " packets sent, " << rate / 1e6
+                 << " Mbps achieved in total (" << traffic_rate << " each requested)");
+
+  uint64_t received = 0;
+  uint64_t lost = 0;
+  for (const auto &sink : flow_sinks)
+    {
+      received += sink->GetPacketsReceived ();
+      for (uint32_t i = 0; i < sink->GetSlotCount (); i++)
+        {
+          lost += sink->GetFlow (i).lost;
+        }
+    }
+  NS_LOG_UNCOND ("Flow sinks: " << received << " packets received, " << lost << " lost");
+  if (sink_dump.is_open ())
+    {
+      for (const auto &sink : flow_sinks)
+        {
+          sink->Dump (sink_dump);
+        }
+      sink_dump.close ();
+    }
+}
+
+void RoutingExperiment::Run(int nSinks, double txp, std::string CSVfileName)
+{
+  if (traffic_mode == "echo")
+    {
+      // Metadata costs every packet, leave it off for high rate runs
+      Packet::EnablePrinting ();
+    }
+  m_txp = txp;
+  m_CSVfileName = CSVfileName;
+    
+  Time::SetResolution (Time::NS);
+  SelectScheduler ();
+  LogComponentEnable ("UdpEchoClientApplication", LOG_LEVEL_ALL);
+  LogComponentEnable ("UdpEchoServerApplication", LOG_LEVEL_ALL);
+
+  // Create clusters and cluster heads
+
+  CreateClusters ();
+
+  if (link_mode == "p2p")
+    {
+      SetupPointToPointLinks ();
+    }
+
+  // Movement
+
+  SetupMobility ();
+
+  AnimationInterface anim("manetSimulator.xml");
+  for(int cluster = 0 ; cluster < maxClusters ; cluster ++){
+      for(uint32_t head = 0 ; head < heads_per_cluster ; head ++){
+          anim.SetConstantPosition(clusterHeads[cluster].Get(head),
+              leftmost_cluster+cluster*30.0+head*8.0, (cluster%2 == 0) ? cluster_head_y : cluster_head_y*1.5 );
+      }
   }
 
-  //Set up latency logger
-  std::vector <Ptr<Socket>> sinks;
-  NS_LOG_UNCOND ("setting up address: " << intoClusterHeadInterfaces[0][0].GetAddress(1) << " with node: " << std::to_string(clusters[0].Get(0)->GetId()));
-  sinks.push_back( SetupPacketReceive(intoClusterHeadInterfaces[0][0].GetAddress(1), clusters[0].Get(0), 9) );
+  if (link_mode == "wireless")
+    {
+      SetupWirelessLinks ();
+    }
+  else
+    {
+      AssignPointToPointAddresses ();
+    }
+
+  // Program calls
+
+  SetupApplications ();
+  if (cluster_multicast)
+    {
+      SetupClusterMulticast ();
+    }
 
-  NS_LOG_UNCOND ("setting up address: " << intoClusterHeadInterfaces[0][1].GetAddress(0) << " with node: " << std::to_string(clusters[0].Get(1)->GetId()));
-  sinks.push_back( SetupPacketReceive(intoClusterHeadInterfaces[0][1].GetAddress(0), clusters[0].Get(1), 9) );
+  if (global_routing)
+    {
+      PopulateGlobalRoutes ();
+    }
+  Config::ConnectWithoutContext ("/NodeList/*/$ns3::Ipv4L3Protocol/Tx", MakeCallback (&OnIpv4Tx));
+  if (head_cache)
+    {
+      InstallHeadCaches (clusterHeads);
+    }
+  if (heads_per_cluster > 1 && link_mode == "p2p")
+    {
+      InstallHeadSelectors ();
+    }
 
-  NS_LOG_UNCOND ("setting up address: " << intoClusterHeadInterfaces[0][2].GetAddress(0) << " with node: " << std::to_string(clusters[0].Get(2)->GetId()));
-  sinks.push_back( SetupPacketReceive(intoClusterHeadInterfaces[0][2].GetAddress(0), clusters[0].Get(2), 9) );
-  Ipv4GlobalRoutingHelper::PopulateRoutingTables ();
+  InitClustering ();
+  ConnectDisplacementTriggers ();
+  if (recluster_interval > 0)
+    {
+      Simulator::Schedule (Seconds (recluster_interval), &ScheduleRecluster, recluster_interval);
+    }
 
   AsciiTraceHelper ascii;
   std::string tr_name ("manet-routing-compare");
   MobilityHelper::EnableAsciiAll (ascii.CreateFileStream (tr_name + ".mob"));
 
-  double envStepTime = 1.0; //seconds, ns3gym env step time interval
-  uint32_t openGymPort = 5555;
-  Ptr<OpenGymInterface> openGym = CreateObject<OpenGymInterface> (openGymPort);
-  openGym->SetGetActionSpaceCb( MakeCallback (&MyGetActionSpace) );
-  openGym->SetGetObservationSpaceCb( MakeCallback (&MyGetObservationSpace) );
-  openGym->SetGetGameOverCb( MakeCallback (&MyGetGameOver) );
-  openGym->SetGetObservationCb( MakeCallback (&MyGetObservation) );
-  
-  openGym->SetGetRewardCb( MakeCallback (&MyGetReward) );
-  openGym->SetExecuteActionsCb( MakeCallback (&MyExecuteActions) );
-  Simulator::Schedule (Seconds(0.0), &ScheduleNextStateRead, envStepTime, openGym);
+  if (trajectory_file != "")
+    {
+      trajectory.Open (trajectory_file, trajectory_compress);
+    }
+  if (agent_mode == "gym")
+    {
+      uint32_t openGymPort = 5555;
+      Ptr<OpenGymInterface> openGym = CreateObject<OpenGymInterface> (openGymPort);
+      gym_interface = openGym;
+      openGym->SetGetActionSpaceCb( MakeCallback (&MyGetActionSpace) );
+      openGym->SetGetObservationSpaceCb( MakeCallback (&MyGetObservationSpace) );
+      openGym->SetGetGameOverCb( MakeCallback (&MyGetGameOver) );
+      openGym->SetGetObservationCb( MakeCallback (&MyGetObservation) );
+
+      openGym->SetGetRewardCb( MakeCallback (&MyGetReward) );
+      openGym->SetExecuteActionsCb( MakeCallback (&MyExecuteActions) );
+    }
+  else
+    {
+      policy_random = CreateObject<UniformRandomVariable> ();
+    }
+  if (step_interval > 0)
+    {
+      Simulator::Schedule (Seconds(0.0), &ScheduleNextStateRead, step_interval);
+    }
+  else
+    {
+      // The agent still needs the initial observation
+      Simulator::ScheduleNow (&RequestGymStep, std::string ("start"));
+    }
+  if (step_queue_threshold > 0)
+    {
+      ConnectQueueTriggers ();
+    }
+  ConnectQueueTelemetry ();
+  StartMetrics ();
 
   //Simulator::Stop (Seconds (TotalTime));
   Ptr<FlowMonitor> flowMonitor;
   FlowMonitorHelper flowHelper;
   flowMonitor = flowHelper.InstallAll();
-  Simulator::Stop (Seconds (30.0));
+  if (convergence_monitor.IsEnabled ())
+    {
+      convergence_monitor.Start ();
+    }
+  Simulator::Stop (Seconds (RunEnd ()));
+  std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now ();
   Simulator::Run ();
+  double wallSeconds = std::chrono::duration<double> (std::chrono::steady_clock::now () - wallStart).count ();
+  NS_LOG_UNCOND ("Scheduler " << scheduler_type << ": " << Simulator::GetEventCount () << " events in "
+                 << wallSeconds << "s wall clock");
+  trajectory.Close ();
+  WriteRoutingReport ();
+  ReportTrafficGenerators ();
+  ReportClusterMatrix ();
+  ReportEchoBreakdown ();
+  ReportQueueTelemetry ();
+  ReportAggregation ();
+  ReportHeadCaches ();
+  ReportClusterMulticast ();
+  ReportHeadLoad ();
+  StopMetrics ();
+  if (recluster_rounds > 0)
+    {
+      NS_LOG_UNCOND ("Clustering: " << recluster_rounds << " rounds, " << member_churn
+                     << " member moves, " << head_churn << " head re-elections");
+    }
+  if (wireless_channel != 0)
+    {
+      NS_LOG_UNCOND ("Wireless channel: " << wireless_channel->GetTransmissions () << " transmissions, "
+                     << wireless_channel->GetCandidates () << " receivers considered");
+    }
   flowMonitor->SerializeToXmlFile("NameOfFile.xml", true, true);
   
 
@@ -0,0 +1,44 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+# Converts a "node,time,x,y[,z]" CSV mobility trace into the binary waypoint
+# trace replayed by manet-simulation.cc --mobilityTrace=<file>.
+# Trace node i drives the i-th cluster member, counting cluster by cluster.
+
+import argparse
+import csv
+import struct
+
+parser = argparse.ArgumentParser(description='Convert a CSV mobility trace to a binary waypoint trace')
+parser.add_argument('csv', help='Input CSV with node,time,x,y[,z] rows')
+parser.add_argument('output', help='Output binary waypoint trace')
+parser.add_argument('--nodes',
+                    type=int,
+                    default=0,
+                    help='Number of nodes in the trace, Default: highest node id + 1')
+args = parser.parse_args()
+
+waypoints = {}
+with open(args.csv) as f:
+    for row in csv.reader(f):
+        if not row or row[0].startswith('#') or not row[0].strip().isdigit():
+            continue
+        node = int(row[0])
+        z = float(row[4]) if len(row) > 4 else 0.0
+        waypoints.setdefault(node, []).append((float(row[1]), float(row[2]), float(row[3]), z))
+
+nodeCount = max(args.nodes, max(waypoints) + 1 if waypoints else 0)
+offset = 16 + nodeCount * 16
+
+with open(args.output, 'wb') as out:
+    out.write(b'NS3WPT1\n')
+    out.write(struct.pack('<II', nodeCount, 0))
+    for node in range(nodeCount):
+        count = len(waypoints.get(node, []))
+        out.write(struct.pack('<QQ', offset, count))
+        offset += count * 32
+    for node in range(nodeCount):
+        for waypoint in sorted(waypoints.get(node, [])):
+            out.write(struct.pack('<dddd', *waypoint))
+
+print("Wrote", nodeCount, "nodes to", args.output)
@@ -30,7 +30,7 @@ simTime = 29 # seconds
 stepTime = 1.0  # seconds
 seed = 0
 simArgs = {"--simTime": simTime,
-           "--testArg": 123}
+           "--stepTime": stepTime}
 debug = False
 
 env = ns3env.Ns3Env(port=port, stepTime=stepTime, startSim=startSim, simSeed=seed, simArgs=simArgs, debug=debug)